@@ -1,31 +1,145 @@
+#define _GNU_SOURCE /* O_DIRECT, statx() */
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <liburing.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
-#define QUEUE_DEPTH 32
-#define BLOCK_SZ (16 * 1024)
+#define QUEUE_DEPTH 32        /* Where autotuning starts */
+#define BLOCK_SZ (16 * 1024)  /* Where autotuning starts, and the minimum */
+#define MAX_QUEUE_DEPTH 64
+#define MAX_BLOCK_SZ (4 * 1024 * 1024)
+#define POOL_SZ (64 * 1024 * 1024) /* Buffers of all blocks in flight */
+#define POOL_BUF_INDEX 0           /* The pool in the registered buffers */
+#define TUNE_INTERVAL_MS 250
+#define TUNE_MIN_GAIN 0.05 /* Smaller improvements are noise */
+#define COPY_RANGE_CHUNK (1l << 30) /* Per copy_file_range() call */
 #define min(x, y) ((x) < (y) ? (x) : (y))
+#define max(x, y) ((x) > (y) ? (x) : (y))
+
+/*
+ * With --link, each block goes out as a read linked to its write
+ * (IOSQE_IO_LINK), so the kernel starts the write as soon as the read is
+ * done instead of waiting for us to see the read's completion. Successful
+ * reads don't even post a CQE (IOSQE_CQE_SKIP_SUCCESS, Linux 5.17+), leaving
+ * one completion per block. The read's user data carries LINKED_READ to tell
+ * the two apart.
+ *
+ * A short read breaks the link and the kernel cancels the write. Once all
+ * CQEs of the pair are in, the block goes on like an unlinked one:
+ * requeue_task() reads the rest, then queue_write() writes the whole block.
+ * With IOSQE_CQE_SKIP_SUCCESS that is just the read's, since the flag also
+ * suppresses the CQEs of the requests canceled after it. Without it, the
+ * write posts -ECANCELED as well.
+ * */
+#define LINKED_READ 1ul
 
 static int infd;
 static int outfd;
 static struct io_uring ring;
+static bool link_mode;
+static bool skip_read_cqes;
+static size_t block_sz = BLOCK_SZ;
+static size_t min_block_sz = BLOCK_SZ;
+static unsigned queue_depth = QUEUE_DEPTH;
+
+/*
+ * With --direct, both files are opened with O_DIRECT so that a copy doesn't
+ * push everything else out of the page cache. Buffers, offsets and lengths
+ * then have to be aligned to what the storage can do directly, see
+ * get_dio_alignment(). Blocks are rounded up to that, and the few bytes past
+ * the last aligned offset are copied through the page cache at the end.
+ * */
+static bool direct_mode;
+static bool offload_enabled = true; /* See copy_offloaded() */
 
 struct io_task {
   bool is_read;
   off_t initial_offset;
   off_t offset;
   size_t initial_len;
-  struct iovec iov;
-  char bytes[0]; /* Flexible Array Member. Real Data Payload. */
+  struct iovec iov; /* The part of bytes still to be read or written */
+  char *bytes;      /* block_sz bytes of the registered pool */
+  int broken_cqes;  /* Of a broken linked pair we've seen so far */
+  struct io_task *next_free;
 };
 
+/*
+ * There are never more than queue_depth blocks in flight, so tasks and their
+ * buffers are set up once and reused for the whole copy. The buffers are
+ * slices of one pool that is registered with the ring: read_fixed and
+ * write_fixed then use pages the kernel pinned at registration instead of
+ * pinning them on every I/O. Registered memory counts against
+ * RLIMIT_MEMLOCK, so the pool shrinks until it fits, which also limits how
+ * far autotuning can take block size times queue depth.
+ * */
+static struct io_task tasks[MAX_QUEUE_DEPTH];
+static struct io_task *free_tasks;
+static char *pool;
+static size_t pool_sz;
+
+/* Cuts the pool into blocks of block_sz. Nothing may be in flight. */
+static void slice_pool() {
+  size_t count = min(pool_sz / block_sz, MAX_QUEUE_DEPTH);
+  free_tasks = NULL;
+  for (size_t i = 0; i < count; i++) {
+    tasks[i].bytes = pool + i * block_sz;
+    tasks[i].next_free = free_tasks;
+    free_tasks = &tasks[i];
+  }
+  queue_depth = min(queue_depth, count);
+}
+
+static void setup_pool(size_t alignment, off_t file_size) {
+  /* No more than the file needs, though. */
+  pool_sz = POOL_SZ;
+  while (pool_sz / 2 >= QUEUE_DEPTH * block_sz && pool_sz / 2 >= file_size) {
+    pool_sz /= 2;
+  }
+
+  if (posix_memalign((void **)&pool, alignment, pool_sz) != 0) {
+    fprintf(stderr, "posix_memalign() failed.");
+    exit(EXIT_FAILURE);
+  }
+
+  while (true) {
+    struct iovec iov = {.iov_base = pool, .iov_len = pool_sz};
+    int ret = io_uring_register_buffers(&ring, &iov, 1);
+    if (ret == 0) {
+      break;
+    }
+
+    if (ret != -ENOMEM || pool_sz / 2 < block_sz) {
+      fprintf(stderr, "io_uring_register_buffers failed: %s\n",
+              strerror(-ret));
+      exit(EXIT_FAILURE);
+    }
+    pool_sz /= 2;
+  }
+
+  slice_pool();
+}
+
+static void prep_task(struct io_uring_sqe *sqe, struct io_task *task) {
+  if (task->is_read) {
+    io_uring_prep_read_fixed(sqe, infd, task->iov.iov_base, task->iov.iov_len,
+                             task->offset, POOL_BUF_INDEX);
+  } else {
+    io_uring_prep_write_fixed(sqe, outfd, task->iov.iov_base,
+                              task->iov.iov_len, task->offset, POOL_BUF_INDEX);
+  }
+
+  io_uring_sqe_set_data(sqe, task);
+}
+
 static off_t get_file_size(int fd) {
   struct stat st;
 
@@ -52,6 +166,73 @@ static off_t get_file_size(int fd) {
   exit(EXIT_FAILURE);
 }
 
+/*
+ * The alignment O_DIRECT needs on fd: the logical block size of a block
+ * device, or what the file system reports through statx() (Linux 6.1+).
+ * Before that there is no asking, but the file system block size is a
+ * multiple of the logical block size and therefore safe.
+ * */
+static size_t get_dio_alignment(int fd) {
+  struct stat st;
+
+  if (fstat(fd, &st) < 0) {
+    fprintf(stderr, "fstat() failed.");
+    exit(EXIT_FAILURE);
+  }
+
+  if (S_ISBLK(st.st_mode)) {
+    int logical_block_size;
+    if (ioctl(fd, BLKSSZGET, &logical_block_size) != 0) {
+      fprintf(stderr, "ioctl() failed.");
+      exit(EXIT_FAILURE);
+    }
+
+    return logical_block_size;
+  }
+
+  struct statx stx;
+  if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+      (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align != 0) {
+    return max(stx.stx_dio_offset_align, stx.stx_dio_mem_align);
+  }
+
+  return st.st_blksize;
+}
+
+/*
+ * Copies the unaligned end of the file in direct mode, with O_DIRECT turned
+ * off again. len is less than the alignment, so one block buffer holds it.
+ * */
+static void copy_tail(off_t offset, size_t len) {
+  if (fcntl(infd, F_SETFL, fcntl(infd, F_GETFL) & ~O_DIRECT) < 0 ||
+      fcntl(outfd, F_SETFL, fcntl(outfd, F_GETFL) & ~O_DIRECT) < 0) {
+    fprintf(stderr, "fcntl() failed: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  char *buf = tasks[0].bytes;
+  size_t done = 0;
+  while (done < len) {
+    ssize_t ret = pread(infd, buf + done, len - done, offset + done);
+    if (ret <= 0) {
+      fprintf(stderr, "pread() failed: %s\n",
+              ret < 0 ? strerror(errno) : "unexpected end of file");
+      exit(EXIT_FAILURE);
+    }
+    done += ret;
+  }
+
+  done = 0;
+  while (done < len) {
+    ssize_t ret = pwrite(outfd, buf + done, len - done, offset + done);
+    if (ret < 0) {
+      fprintf(stderr, "pwrite() failed: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    done += ret;
+  }
+}
+
 static void requeue_task(struct io_task *task) {
   struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
   if (sqe == NULL) {
@@ -59,36 +240,61 @@ static void requeue_task(struct io_task *task) {
     exit(EXIT_FAILURE);
   }
 
-  if (task->is_read) {
-    io_uring_prep_readv(sqe, infd, &task->iov, 1, task->offset);
-  } else {
-    io_uring_prep_writev(sqe, outfd, &task->iov, 1, task->offset);
-  }
-
-  io_uring_sqe_set_data(sqe, task);
+  prep_task(sqe, task);
+  io_uring_submit(&ring);
 }
 
 static int queue_read(off_t size, off_t offset) {
+  struct io_task *task = free_tasks;
+  if (!task) {
+    return -1;
+  }
+
   struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
   if (sqe == NULL) {
     return -1;
   }
+  free_tasks = task->next_free;
 
-  struct io_task *task = malloc(sizeof(*task) + size);
-  if (!task) {
+  task->is_read = true;
+  task->initial_offset = offset;
+  task->offset = offset;
+  task->initial_len = size;
+
+  task->iov.iov_base = task->bytes;
+  task->iov.iov_len = task->initial_len;
+
+  prep_task(sqe, task);
+  return 0;
+}
+
+static int queue_linked(off_t size, off_t offset) {
+  struct io_task *task = free_tasks;
+  if (!task || io_uring_sq_space_left(&ring) < 2) {
     return -1;
   }
+  free_tasks = task->next_free;
 
-  task->is_read = true;
+  task->is_read = false;
   task->initial_offset = offset;
   task->offset = offset;
   task->initial_len = size;
+  task->broken_cqes = 0;
+
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+  io_uring_prep_read_fixed(sqe, infd, task->bytes, size, offset,
+                           POOL_BUF_INDEX);
+  io_uring_sqe_set_data64(sqe, (uintptr_t)task | LINKED_READ);
+  sqe->flags |= IOSQE_IO_LINK;
+  if (skip_read_cqes) {
+    sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+  }
 
   task->iov.iov_base = task->bytes;
   task->iov.iov_len = task->initial_len;
 
-  io_uring_prep_readv(sqe, infd, &task->iov, 1, offset);
-  io_uring_sqe_set_data(sqe, task);
+  sqe = io_uring_get_sqe(&ring);
+  prep_task(sqe, task);
   return 0;
 }
 
@@ -105,32 +311,171 @@ static void queue_write(struct io_task *task) {
   task->iov.iov_base = task->bytes;
   task->iov.iov_len = task->initial_len;
 
-  io_uring_prep_writev(sqe, outfd, &task->iov, 1, task->offset);
-  io_uring_sqe_set_data(sqe, task);
+  prep_task(sqe, task);
+}
+
+/*
+ * Autotuning. The best block size and queue depth differ wildly between
+ * NVMe, SATA SSDs, spinning disks and tmpfs, so copy_file() looks for them
+ * while it copies. Starting from BLOCK_SZ and QUEUE_DEPTH, every setting
+ * runs for TUNE_INTERVAL_MS and the throughput decides the next one. We
+ * hill-climb on the block size first and on the depth second: double while
+ * that beats the best so far by TUNE_MIN_GAIN, or halve if the first
+ * doubling didn't help, then keep the best. That takes a few seconds, after
+ * which the settings stay as they are for the rest of the copy.
+ *
+ * A new depth applies right away. A new block size needs the pool cut up
+ * differently, so reads stop until everything in flight is done.
+ * */
+struct tuner {
+  bool done;
+  bool draining;
+  bool trial;     /* Measuring a candidate rather than the start */
+  int dimension;  /* 0: block size, 1: queue depth, 2: done */
+  int direction;  /* 1: doubling, -1: halving */
+  bool improved;  /* Going in this direction helped */
+  double best_rate;
+  size_t best_block_sz;
+  unsigned best_depth;
+  struct timespec start;
+  off_t start_written;
+};
+
+static struct tuner tuner = {.direction = 1};
+
+static double seconds_since(const struct timespec *start,
+                            const struct timespec *now) {
+  return (now->tv_sec - start->tv_sec) +
+         (now->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* The next setting to try from the best one, if it's possible at all. */
+static bool tuner_candidate(size_t *block, unsigned *depth) {
+  *block = tuner.best_block_sz;
+  *depth = tuner.best_depth;
+  if (tuner.dimension == 0) {
+    *block = tuner.direction > 0 ? *block * 2 : *block / 2;
+    *depth = min(*depth, pool_sz / *block);
+  } else {
+    *depth = tuner.direction > 0 ? *depth * 2 : *depth / 2;
+  }
+
+  return *block >= min_block_sz && *block <= MAX_BLOCK_SZ && *depth >= 1 &&
+         *depth <= MAX_QUEUE_DEPTH && *block * *depth <= pool_sz;
+}
+
+/* This direction is exhausted: try the other one, or the next dimension. */
+static void tuner_turn() {
+  if (tuner.direction > 0 && !tuner.improved) {
+    tuner.direction = -1;
+  } else {
+    tuner.dimension++;
+    tuner.direction = 1;
+    tuner.improved = false;
+  }
+}
+
+static void tuner_apply(size_t block, unsigned depth) {
+  queue_depth = depth;
+  if (block != block_sz) {
+    block_sz = block;
+    tuner.draining = true;
+  }
+}
+
+static void tuner_step(double rate) {
+  bool better = rate > tuner.best_rate * (1 + TUNE_MIN_GAIN);
+  if (better) {
+    tuner.best_rate = rate;
+    tuner.best_block_sz = block_sz;
+    tuner.best_depth = queue_depth;
+  }
+
+  if (tuner.trial) {
+    if (better) {
+      tuner.improved = true;
+    } else {
+      tuner_turn();
+    }
+  }
+
+  size_t block = block_sz;
+  unsigned depth = queue_depth;
+  while (tuner.dimension < 2 && !tuner_candidate(&block, &depth)) {
+    tuner_turn();
+  }
+
+  if (tuner.dimension == 2) {
+    tuner.done = true;
+    tuner_apply(tuner.best_block_sz, tuner.best_depth);
+    printf("Tuned to %zu KB blocks at queue depth %u, %.1f MB/s\n",
+           block_sz / 1024, queue_depth, tuner.best_rate / (1024 * 1024));
+    return;
+  }
+
+  tuner.trial = true;
+  tuner_apply(block, depth);
+}
+
+/*
+ * Called between batches with the bytes written and blocks in flight. A new
+ * block size takes effect as soon as nothing is in flight, which may already
+ * be the case when tuner_step() picks it: buffered I/O often completes
+ * inline.
+ * */
+static void tune(off_t written, unsigned long in_flight) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  if (!tuner.draining && !tuner.done) {
+    double elapsed = seconds_since(&tuner.start, &now);
+    if (elapsed < TUNE_INTERVAL_MS / 1000.0) {
+      return;
+    }
+
+    tuner_step((written - tuner.start_written) / elapsed);
+    tuner.start = now;
+    tuner.start_written = written;
+  }
+
+  if (tuner.draining && in_flight == 0) {
+    tuner.draining = false;
+    slice_pool();
+    tuner.start = now;
+    tuner.start_written = written;
+  }
 }
 
 void spawn_read_tasks(unsigned long *read_tasks, unsigned long *write_tasks,
                       off_t *bytes_to_read, off_t *read_offset) {
   /* Queue up as many reads as we can */
   unsigned long previous_read_tasks = *read_tasks;
-  while (*bytes_to_read > 0) {
-    if (*read_tasks + *write_tasks >= QUEUE_DEPTH) {
+  unsigned long previous_write_tasks = *write_tasks;
+  while (*bytes_to_read > 0 && !tuner.draining) {
+    if (*read_tasks + *write_tasks >= queue_depth) {
       break;
     }
 
-    off_t read_size = min(*bytes_to_read, BLOCK_SZ);
+    off_t read_size = min(*bytes_to_read, (off_t)block_sz);
 
-    int ret = queue_read(read_size, *read_offset);
+    int ret = link_mode ? queue_linked(read_size, *read_offset)
+                        : queue_read(read_size, *read_offset);
     if (ret < 0) {
       break;
     }
 
     *bytes_to_read -= read_size;
     *read_offset += read_size;
-    *read_tasks += 1;
+    /* A linked block counts as a write from the start. */
+    if (link_mode) {
+      *write_tasks += 1;
+    } else {
+      *read_tasks += 1;
+    }
   }
 
-  if (previous_read_tasks < *read_tasks) {
+  if (previous_read_tasks + previous_write_tasks <
+      *read_tasks + *write_tasks) {
     int ret = io_uring_submit(&ring);
     if (ret < 0) {
       fprintf(stderr, "io_uring_submit failed: %s\n", strerror(-ret));
@@ -166,7 +511,39 @@ void spawn_write_tasks(unsigned long *read_tasks, unsigned long *write_tasks,
       }
     }
 
-    struct io_task *task = io_uring_cqe_get_data(cqe);
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    struct io_task *task = (struct io_task *)(uintptr_t)(data & ~LINKED_READ);
+    if (data & LINKED_READ) {
+      /* Without IOSQE_CQE_SKIP_SUCCESS, good reads post a CQE too. */
+      if (cqe->res == task->initial_len) {
+        io_uring_cqe_seen(&ring, cqe);
+        continue;
+      }
+
+      if (cqe->res < 0 && cqe->res != -EAGAIN) {
+        fprintf(stderr, "cqe failed: %s\n", strerror(-cqe->res));
+        exit(EXIT_FAILURE);
+      }
+
+      if (cqe->res > 0) {
+        task->iov.iov_base += cqe->res;
+        task->iov.iov_len -= cqe->res;
+        task->offset += cqe->res;
+      }
+      task->is_read = true;
+    }
+
+    if ((data & LINKED_READ) || cqe->res == -ECANCELED) {
+      /* Only the write of a broken linked pair gets canceled. */
+      if (++task->broken_cqes == (skip_read_cqes ? 1 : 2)) {
+        *write_tasks -= 1;
+        *read_tasks += 1;
+        requeue_task(task);
+      }
+      io_uring_cqe_seen(&ring, cqe);
+      continue;
+    }
+
     if (cqe->res == -EAGAIN) { // EAGAIN means retry.
       requeue_task(task);
       /* Notify kernel that a CQE has been consumed successfully. */
@@ -183,6 +560,7 @@ void spawn_write_tasks(unsigned long *read_tasks, unsigned long *write_tasks,
       /* short read/write; adjust and requeue */
       task->iov.iov_base += cqe->res;
       task->iov.iov_len -= cqe->res;
+      task->offset += cqe->res;
       requeue_task(task);
       /* Notify kernel that a CQE has been consumed successfully. */
       io_uring_cqe_seen(&ring, cqe);
@@ -200,7 +578,8 @@ void spawn_write_tasks(unsigned long *read_tasks, unsigned long *write_tasks,
       *write_tasks += 1;
     } else {
       *bytes_to_write -= task->initial_len;
-      free(task);
+      task->next_free = free_tasks;
+      free_tasks = task;
       *write_tasks -= 1;
     }
 
@@ -217,39 +596,165 @@ void copy_file(off_t file_size) {
   unsigned long read_tasks = 0;
   unsigned long write_tasks = 0;
 
+  tuner.best_block_sz = block_sz;
+  tuner.best_depth = queue_depth;
+  clock_gettime(CLOCK_MONOTONIC, &tuner.start);
   while (bytes_to_read > 0 || bytes_to_write > 0) {
+    tune(file_size - bytes_to_write, read_tasks + write_tasks);
     spawn_read_tasks(&read_tasks, &write_tasks, &bytes_to_read, &read_offset);
     spawn_write_tasks(&read_tasks, &write_tasks, &bytes_to_write);
   }
+
+  if (!tuner.done && file_size > 0) {
+    printf("Done before tuning settled, at %zu KB blocks and queue depth %u\n",
+           block_sz / 1024, queue_depth);
+  }
+}
+
+/*
+ * Copies without moving the data through our buffers, if the file systems
+ * allow it. FICLONE makes the copy share the extents of the original
+ * (reflink, on Btrfs, XFS and others), which takes next to no time whatever
+ * the size. Failing that, copy_file_range() has the kernel do the copy, or
+ * the server on network file systems. Returns false if neither works, e.g.
+ * across file systems or for block devices, and nothing has been copied.
+ *
+ * With --direct, only the clone is tried: copy_file_range() mostly falls
+ * back to copying through the page cache.
+ * */
+static bool copy_offloaded(off_t file_size) {
+  if (ioctl(outfd, FICLONE, infd) == 0) {
+    printf("Cloned %ld bytes with FICLONE\n", (long)file_size);
+    return true;
+  }
+
+  if (direct_mode) {
+    return false;
+  }
+
+  off_t in_offset = 0;
+  off_t out_offset = 0;
+  while (in_offset < file_size) {
+    ssize_t ret = copy_file_range(infd, &in_offset, outfd, &out_offset,
+                                  min(file_size - in_offset, COPY_RANGE_CHUNK),
+                                  0);
+    if (ret < 0 && in_offset == 0 &&
+        (errno == EXDEV || errno == EOPNOTSUPP || errno == EINVAL ||
+         errno == ENOSYS)) {
+      return false;
+    }
+
+    if (ret < 0) {
+      fprintf(stderr, "copy_file_range() failed: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+
+    if (ret == 0) {
+      break; /* The file got shorter since we looked */
+    }
+  }
+
+  printf("Copied %ld bytes with copy_file_range()\n", (long)in_offset);
+  return true;
+}
+
+static void copy_through_ring(off_t insize) {
+  off_t aligned_size = insize;
+  size_t alignment = sysconf(_SC_PAGESIZE);
+  if (direct_mode) {
+    alignment = max(alignment,
+                    max(get_dio_alignment(infd), get_dio_alignment(outfd)));
+    block_sz = (BLOCK_SZ + alignment - 1) / alignment * alignment;
+    min_block_sz = block_sz;
+    aligned_size = insize - insize % alignment;
+
+    /*
+     * Direct writes past the end of a file have to grow it and are
+     * serialized by most file systems, so give it its final size first.
+     * */
+    struct stat st;
+    if (fstat(outfd, &st) == 0 && S_ISREG(st.st_mode) &&
+        ftruncate(outfd, insize) < 0) {
+      fprintf(stderr, "ftruncate() failed: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  setup_pool(alignment, aligned_size);
+
+  copy_file(aligned_size);
+  if (aligned_size < insize) {
+    copy_tail(aligned_size, insize - aligned_size);
+  }
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [--link] [--direct] [--no-offload] <infile> <outfile>\n"
+         "  --link        submit each block as a linked read and write\n"
+         "  --direct      bypass the page cache with O_DIRECT\n"
+         "  --no-offload  always copy through io_uring, never with FICLONE or\n"
+         "                copy_file_range()\n",
+         prog);
+  exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    printf("Usage: %s <infile> <outfile>\n", argv[0]);
-    exit(EXIT_FAILURE);
+  static const struct option options[] = {
+      {"link", no_argument, NULL, 'l'},
+      {"direct", no_argument, NULL, 'd'},
+      {"no-offload", no_argument, NULL, 'n'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "ldn", options, NULL)) != -1) {
+    switch (opt) {
+    case 'l':
+      link_mode = true;
+      break;
+    case 'd':
+      direct_mode = true;
+      break;
+    case 'n':
+      offload_enabled = false;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (argc - optind != 2) {
+    usage(argv[0]);
   }
 
-  infd = open(argv[1], O_RDONLY);
+  int direct_flag = direct_mode ? O_DIRECT : 0;
+  infd = open(argv[optind], O_RDONLY | direct_flag);
   if (infd < 0) {
     fprintf(stderr, "open infile failed");
     exit(EXIT_FAILURE);
   }
 
-  outfd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  outfd = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC | direct_flag,
+               0644);
   if (outfd < 0) {
     fprintf(stderr, "open outfile failed");
     exit(EXIT_FAILURE);
   }
 
-  int ret = io_uring_queue_init(QUEUE_DEPTH, &ring, 0);
+  /* Linked blocks take two SQEs each. */
+  int ret =
+      io_uring_queue_init(link_mode ? 2 * MAX_QUEUE_DEPTH : MAX_QUEUE_DEPTH,
+                          &ring, 0);
   if (ret < 0) {
     fprintf(stderr, "io_uring_queue_init failed: %s\n", strerror(-ret));
     exit(EXIT_FAILURE);
   }
+  skip_read_cqes = link_mode && (ring.features & IORING_FEAT_CQE_SKIP);
 
   off_t insize = get_file_size(infd);
-
-  copy_file(insize);
+  if (!offload_enabled || !copy_offloaded(insize)) {
+    copy_through_ring(insize);
+  }
 
   io_uring_queue_exit(&ring);
   close(outfd);
@@ -1,41 +1,357 @@
+#define _GNU_SOURCE /* pthread_setaffinity_np(), strerrorname_np(), timegm() */
+
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <liburing.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #define DEFAULT_SERVER_PORT 8000
 #define QUEUE_DEPTH 256
 #define READ_SZ 8192
+#define BUF_RING_ENTRIES 512 /* Must be a power of 2 */
+#define BUF_GROUP_ID 0
+#define HEADER_IOVEC_COUNT 9
+#define HEADER_BUF_SZ 48      /* The content-length line */
+#define RANGE_BUF_SZ 96       /* The content-range line */
+#define VALIDATORS_BUF_SZ 128 /* The ETag and Last-Modified lines */
+#define ETAG_SZ 48
+#define IF_RANGE_SZ 64        /* Longer If-Range validators never match */
+#define IF_NONE_MATCH_SZ 256  /* Longer If-None-Match lists are ignored */
+#define HTTP_DATE_SZ 30       /* "Sun, 06 Nov 1994 08:49:37 GMT" */
+#define REQUEST_CHUNK_SZ 1024 /* Requests allocated at once by the slab */
+#define CACHE_BUCKETS 256                    /* Must be a power of 2 */
+#define CACHE_MAX_FILE_SZ (1024 * 1024)      /* Larger files aren't cached */
+#define CACHE_MAX_TOTAL_SZ (64 * 1024 * 1024) /* Budget for all cached files */
+#define INOTIFY_BUF_SZ 4096
+#define SPLICE_CHUNK_SZ (256 * 1024)
+#define MAX_CONNECTIONS 16384 /* Registered file slots per worker */
+#define MAX_HEADERS 64          /* Requests with more headers get a 400 */
+#define TIMER_WHEEL_SLOTS 64    /* Must be a power of 2, > every timeout */
+#define IDLE_TIMEOUT_SEC 15     /* Waiting for the next request */
+#define REQUEST_TIMEOUT_SEC 10  /* Receiving the headers of a request */
+#define WRITE_TIMEOUT_SEC 30    /* Without the client taking any data */
+#define ERROR_COUNTERS 256      /* errno values we count separately */
+#define STATS_INTERVAL_SEC 10
+#define ZEROCOPY_MIN_SZ (32 * 1024) /* Smaller bodies are cheaper to copy */
+#define ZEROCOPY_BUFFERS 1024       /* Registered buffer slots per worker */
 #define min(x, y) ((x) < (y) ? (x) : (y))
 
-int server_socket;
-struct sockaddr_in client_addr;
-socklen_t client_addr_len = sizeof(client_addr);
-struct io_uring ring;
+/*
+ * Every worker thread runs its own copy of the server: its own ring,
+ * listening socket, buffers and cache. All mutable state below is therefore
+ * thread-local and nothing is shared or locked between workers.
+ * */
+_Thread_local int server_socket;
+_Thread_local struct io_uring ring;
+
+/*
+ * Kernel-provided receive buffers. Reads don't carry a buffer of their own;
+ * the kernel picks one from this ring only when data actually arrives and
+ * tells us which one in the CQE. Idle connections therefore hold no memory.
+ * */
+_Thread_local struct io_uring_buf_ring *buf_ring;
+_Thread_local char *buf_ring_pool;
+
+/*
+ * Client sockets never get a regular file descriptor: the kernel accepts
+ * them straight into a slot of the ring's registered file table, so every
+ * operation on them skips the fget()/fput() of a normal fd. When the table
+ * is full, accepting is paused until a connection closes.
+ * */
+_Thread_local bool accept_paused;
 
 enum event_type {
   EVENT_TYPE_ACCEPT,
   EVENT_TYPE_READ,
   EVENT_TYPE_WRITE,
+  EVENT_TYPE_INOTIFY,
+  EVENT_TYPE_SPLICE_IN,  /* file -> pipe */
+  EVENT_TYPE_SPLICE_OUT, /* pipe -> socket */
+  EVENT_TYPE_PATH_STATX, /* Revalidation, before the file is opened */
+  EVENT_TYPE_OPENAT,
+  EVENT_TYPE_STATX,
+  EVENT_TYPE_SIDECAR_STATX, /* Looking for precompressed variants */
+  EVENT_TYPE_FILE_READ,
+  EVENT_TYPE_CLOSE,
+  EVENT_TYPE_TIMER,
+  EVENT_TYPE_CANCEL,
+  EVENT_TYPE_SEND_ZC,
+};
+
+enum conn_state {
+  CONN_STATE_READING,
+  CONN_STATE_WRITING,
+};
+
+struct request;
+struct mime_type;
+
+/*
+ * Precompressed variants. Next to "style.css" there may be "style.css.br"
+ * and "style.css.gz", made at deploy time with any compression level. For a
+ * client that accepts one of them (see parse_accept_encoding()), we send it
+ * instead of the file itself, with the Content-Type of the original and a
+ * Content-Encoding header. Nothing is compressed while serving.
+ *
+ * Sidecars are only looked for next to files of a compressible type, and
+ * their responses as well as those of the original say "Vary:
+ * Accept-Encoding" so that caches keep the variants apart. Every variant is
+ * a file of its own as far as the cache, ranges and validators go.
+ * */
+enum content_encoding {
+  ENCODING_IDENTITY,
+  ENCODING_GZIP,
+  ENCODING_BR,
+  ENCODING_COUNT,
+};
+
+struct encoding {
+  const char *name;   /* In Accept-Encoding and Content-Encoding */
+  const char *suffix; /* Of the sidecar file */
+  const char *headers;
+};
+
+const struct encoding encodings[ENCODING_COUNT] = {
+    [ENCODING_IDENTITY] = {"identity", "", "Vary: Accept-Encoding\r\n"},
+    [ENCODING_GZIP] = {"gzip", ".gz",
+                       "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n"},
+    [ENCODING_BR] = {"br", ".br",
+                     "Content-Encoding: br\r\nVary: Accept-Encoding\r\n"},
+};
+
+/* Best first. */
+const enum content_encoding sidecar_preference[] = {ENCODING_BR,
+                                                     ENCODING_GZIP};
+
+#define SIDECAR_COUNT (sizeof(sidecar_preference) / sizeof(*sidecar_preference))
+#define ENCODING_BIT(encoding) (1u << (encoding))
+
+/*
+ * A cached static file. Both the file contents and a fully serialized header
+ * block are kept, so serving a hit is a writev of two buffers we already
+ * have. Entries are shared by every response in flight that uses them and
+ * freed when the last reference is dropped; being in the cache counts as one
+ * reference.
+ * */
+struct cache_entry {
+  struct cache_entry *next; /* Next entry in the same hash bucket */
+  char *path;
+  int refcount;
+  int wd;                 /* inotify watch on the file, -1 without inotify */
+  struct timespec mtime;  /* Revalidates the entry when inotify is missing */
+  off_t size;
+  struct iovec headers[2]; /* Indexed by whether the connection stays open */
+  struct iovec body;
+  int buf_index; /* Registered buffer holding body for send_zc, or -1 */
+  const struct mime_type *content_type; /* Of the original, for sidecars */
+  enum content_encoding encoding;
+  unsigned sidecars; /* ENCODING_BITs of the sidecars next to the original */
+};
+
+/*
+ * Body of a response too large to cache, sent after the response's iovecs.
+ * */
+struct file_stream {
+  int file_fd;
+  int pipe_fds[2];
+  off_t offset;    /* Next file offset to splice into the pipe */
+  off_t remaining; /* Bytes not yet spliced into the pipe */
+  size_t in_pipe;  /* Bytes in the pipe not yet sent to the socket */
+  int inflight;    /* Splice requests we are still waiting for */
+  bool truncated;  /* The file shrank after we sent content-length */
+  bool failed;     /* A splice failed, e.g. because the client is gone */
 };
 
+/*
+ * A "Range: bytes=first-last" request header, not yet checked against the
+ * file. Only a single range is supported; a request for several gets the
+ * whole file, which HTTP allows.
+ * */
+struct byte_range {
+  bool requested;
+  off_t first; /* -1 for the last "last" bytes, as in "bytes=-500" */
+  off_t last;  /* -1 for everything from first on, as in "bytes=500-" */
+  char if_range[IF_RANGE_SZ]; /* The If-Range validator, or empty */
+};
+
+/*
+ * What a client already has of a file, from If-None-Match and
+ * If-Modified-Since. If it is still current, the answer is a 304 without
+ * a body, see is_not_modified().
+ * */
+struct preconditions {
+  char if_none_match[IF_NONE_MATCH_SZ]; /* ETags, or empty */
+  time_t if_modified_since;             /* -1 if not sent */
+};
+
+/*
+ * A file being opened, stat'ed and possibly read on behalf of a response.
+ * The response itself is the user data of each of these operations and only
+ * one of them is in flight at a time.
+ * */
+struct file_request {
+  struct file_request *next_loading; /* In loading_files while being read */
+  char path[1024];
+  bool keep_alive; /* Connection header to send, as of the request */
+  struct byte_range range;
+  struct preconditions preconditions;
+  const struct mime_type *content_type; /* Of the original file */
+  unsigned accepted;  /* ENCODING_BITs of the sidecars we may send */
+  enum content_encoding encoding; /* Of the file at path */
+  unsigned sidecars;  /* ENCODING_BITs of the sidecars found so far */
+  size_t sidecar;     /* Index in sidecar_preference being looked for */
+  char sidecar_path[1024 + 4];
+  int fd;
+  int wd;         /* inotify watch placed before reading, or -1 */
+  bool stale;     /* The file changed while we were reading it */
+  struct statx stx;
+  struct statx sidecar_stx;
+  char *body;
+  off_t bytes_read;
+};
+
+_Thread_local struct cache_entry *cache[CACHE_BUCKETS];
+_Thread_local size_t cache_total_sz;
+_Thread_local int inotify_fd = -1;
+_Thread_local char inotify_buf[INOTIFY_BUF_SZ]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+_Thread_local struct file_request *loading_files;
+
+/*
+ * A part of a request, as an offset and a length relative to the first byte
+ * of the request. Nothing is copied out of the buffer the request was read
+ * into, and since offsets don't care where that buffer lives, the slices of
+ * a half-parsed request stay valid when it is moved into conn->partial.
+ * */
+struct http_slice {
+  uint16_t off;
+  uint16_t len;
+};
+
+_Static_assert(READ_SZ <= UINT16_MAX, "requests must fit in an http_slice");
+
+struct http_header {
+  struct http_slice name;
+  struct http_slice value; /* Without surrounding whitespace */
+};
+
+enum http_parse_state {
+  HTTP_PARSE_REQUEST_LINE,
+  HTTP_PARSE_HEADERS,
+};
+
+/*
+ * The request being parsed on a connection. Parsing resumes at pos, the
+ * start of the first line that hadn't completely arrived yet, so each line
+ * is only scanned again if it was cut off by the end of a read.
+ * */
+struct http_parser {
+  enum http_parse_state state;
+  size_t pos;
+  struct http_slice method;
+  struct http_slice path;
+  struct http_slice version; /* Empty for a HTTP/0.9 style request line */
+  int header_count;
+  struct http_header headers[MAX_HEADERS];
+};
+
+/*
+ * Per-connection state. It is created when the multishot accept hands us a new
+ * client socket and lives until the socket is closed, so every read and write
+ * request on that socket points back to the same object.
+ *
+ * Connections are persistent (HTTP/1.1 keep-alive): the state machine goes
+ * READING -> WRITING -> READING ... until either side asks to close. Several
+ * pipelined requests may arrive in one read; their responses are queued on
+ * write_head and written one at a time so they reach the client in order.
+ * */
+struct conn {
+  int client_socket; /* Slot in the registered file table, not an fd */
+  enum conn_state state;
+  bool keep_alive;
+  struct request *write_head;
+  struct request *write_tail;
+  /* Start of a request whose remaining bytes haven't been read yet. */
+  char *partial;
+  size_t partial_len;
+  struct http_parser parser;
+  /* Position in the timer wheel, see conn_set_timeout(). */
+  struct conn *timer_next;
+  struct conn **timer_pprev;
+  unsigned deadline;
+  bool timed_out;
+};
+
+/*
+ * Every operation we hand to the ring is described by a request. Requests
+ * have a fixed size and come from a slab (see alloc_request()), so the
+ * iovecs of a response and the header lines that have to be formatted per
+ * response live inside the request itself. All other iovecs point at static
+ * strings or at cache entries; nothing they point to is owned by a request.
+ * */
 struct request {
   enum event_type event_type;
-  int client_socket;
+  unsigned id;          /* Slab slot, used as the SQE's user_data */
+  struct conn *conn;
+  struct request *next; /* Next response on the same connection, or next
+                           free request in the slab */
   int iovec_count;
-  struct iovec iov[0]; /* Flexible Array Member */
+  int iov_first; /* First iovec not yet completely written */
+  struct cache_entry *cache_entry; /* If set, iov[] borrows its buffers */
+  struct file_stream *stream;      /* If set, streamed after iov[] */
+  struct file_request *file;       /* Set until the file is open and read */
+  struct iovec iov[HEADER_IOVEC_COUNT + 1];
+  char header_buf[HEADER_BUF_SZ];
+  char range_buf[RANGE_BUF_SZ];
+  char validators_buf[VALIDATORS_BUF_SZ];
 };
 
+/*
+ * The request slab. Requests are handed out from a free list and only come
+ * from malloc() when the list runs dry, REQUEST_CHUNK_SZ at a time; chunks
+ * are never freed or moved. A request's id is its position across all
+ * chunks, which is what we put in user_data instead of a pointer.
+ * */
+_Thread_local struct request **request_chunks;
+_Thread_local unsigned request_chunk_count;
+_Thread_local struct request *free_requests;
+
+/*
+ * There is only ever one accept in flight: a multishot accept keeps posting a
+ * CQE for every new connection, so its request is allocated once and never
+ * freed.
+ * */
+_Thread_local struct request *accept_req;
+
+/* Likewise, one read on the inotify fd is always pending. */
+_Thread_local struct request *inotify_req;
+
+/* Shared by every close, since nothing waits for them to finish. */
+_Thread_local struct request *close_req;
+
+/* The timer wheel's tick and the cancellations of expired connections. */
+_Thread_local struct request *timer_req;
+_Thread_local struct request *cancel_req;
+
 const char *unimplemented_content =
-    "HTTP/1.0 400 Bad Request\r\n"
-    "Content-type: text/html\r\n"
-    "\r\n"
     "<html>"
     "<head>"
     "<title>ZeroHTTPd: Unimplemented</title>"
@@ -47,10 +363,7 @@ const char *unimplemented_content =
     "</body>"
     "</html>";
 
-const char *http_404_content = "HTTP/1.0 404 Not Found\r\n"
-                               "Content-type: text/html\r\n"
-                               "\r\n"
-                               "<html>"
+const char *http_404_content = "<html>"
                                "<head>"
                                "<title>ZeroHTTPd: Not Found</title>"
                                "</head>"
@@ -61,15 +374,78 @@ const char *http_404_content = "HTTP/1.0 404 Not Found\r\n"
                                "</body>"
                                "</html>";
 
+const char *http_503_content = "<html>"
+                               "<head>"
+                               "<title>ZeroHTTPd: Unavailable</title>"
+                               "</head>"
+                               "<body>"
+                               "<h1>Service Unavailable (503)</h1>"
+                               "<p>The server is out of resources right now. "
+                               "Please try again later.</p>"
+                               "</body>"
+                               "</html>";
+
+const char *http_416_content = "<html>"
+                               "<head>"
+                               "<title>ZeroHTTPd: Range Not Satisfiable</title>"
+                               "</head>"
+                               "<body>"
+                               "<h1>Range Not Satisfiable (416)</h1>"
+                               "<p>The requested range is not part of the "
+                               "file.</p>"
+                               "</body>"
+                               "</html>";
+
 /*
- * Utility function to convert a string to lower case.
+ * Failures the server recovered from. A client that resets its connection
+ * or sends garbage only costs that client its connection, but we still want
+ * to see how often it happens under real traffic. Each worker counts its own
+ * by errno and prints them every STATS_INTERVAL_SEC seconds if they changed.
  * */
+_Thread_local int worker_id;
+_Thread_local unsigned long error_counts[ERROR_COUNTERS];
+_Thread_local unsigned long malformed_requests;
+_Thread_local bool errors_changed;
+
+void count_error(int err) {
+  error_counts[err > 0 && err < ERROR_COUNTERS ? err : 0]++;
+  errors_changed = true;
+}
+
+void count_malformed_request() {
+  malformed_requests++;
+  errors_changed = true;
+}
 
-void str_tolower(char *str) {
-  for (; *str; ++str) {
-    *str = (char)tolower(*str);
+void report_errors() {
+  if (!errors_changed) {
+    return;
+  }
+  errors_changed = false;
+
+  char line[1024];
+  int len = snprintf(line, sizeof(line), "worker %d errors:", worker_id);
+  if (malformed_requests > 0 && len < (int)sizeof(line)) {
+    len += snprintf(line + len, sizeof(line) - len, " malformed=%lu",
+                    malformed_requests);
+  }
+  for (int err = 0; err < ERROR_COUNTERS && len < (int)sizeof(line); err++) {
+    if (error_counts[err] == 0) {
+      continue;
+    }
+
+    const char *name = err > 0 ? strerrorname_np(err) : NULL;
+    if (name != NULL) {
+      len += snprintf(line + len, sizeof(line) - len, " %s=%lu", name,
+                      error_counts[err]);
+    } else {
+      len += snprintf(line + len, sizeof(line) - len, " errno%d=%lu", err,
+                      error_counts[err]);
+    }
   }
+  fprintf(stderr, "%s\n", line);
 }
+
 /*
  One function that prints the system call and the error details
  and then exits with error code 1. Non-zero meaning things didn't go well.
@@ -79,9 +455,142 @@ void fatal_error(const char *syscall) {
   exit(1);
 }
 
+/*
+ * SQPOLL mode (-s). A kernel thread polls the submission queue, so queueing
+ * an SQE is all it takes to submit it, and server_loop() only enters the
+ * kernel to sleep when no completion is ready. The worker rings all attach
+ * to one ring that main() sets up (IORING_SETUP_ATTACH_WQ) and so share a
+ * single SQ thread, which -c pins to a CPU.
+ *
+ * After sqpoll_idle_ms without work the SQ thread sleeps and sets
+ * IORING_SQ_NEED_WAKEUP, and the next submission has to wake it with a
+ * system call after all. Every worker counts how often that happens and
+ * prints it with its errors: many wakeups mean the idle time is too short
+ * for the traffic, or the core would be better spent elsewhere.
+ * */
+int sqpoll_idle_ms = -1; /* -1 without SQPOLL */
+int sqpoll_cpu = -1;
+struct io_uring sqpoll_ring; /* Owns the SQ thread */
+_Thread_local unsigned long sq_submits; /* Batches handed to the SQ thread */
+_Thread_local unsigned long sq_wakeups; /* Batches that had to wake it */
+_Thread_local unsigned long cq_waits;   /* Sleeps waiting for completions */
+_Thread_local unsigned long sq_reported_submits;
+
+void report_sqpoll() {
+  if (sqpoll_idle_ms < 0 || sq_submits == sq_reported_submits) {
+    return;
+  }
+  sq_reported_submits = sq_submits;
+
+  fprintf(stderr, "worker %d sqpoll: submits=%lu wakeups=%lu waits=%lu\n",
+          worker_id, sq_submits, sq_wakeups, cq_waits);
+}
+
+/*
+ * Hands everything queued to the kernel. With SQPOLL, io_uring_submit() only
+ * makes a system call if the SQ thread is asleep, which we check just before
+ * to count it.
+ * */
+void submit_sqes() {
+  if (sqpoll_idle_ms >= 0 && io_uring_sq_ready(&ring) > 0) {
+    sq_submits++;
+    if (IO_URING_READ_ONCE(*ring.sq.kflags) & IORING_SQ_NEED_WAKEUP) {
+      sq_wakeups++;
+    }
+  }
+
+  io_uring_submit(&ring);
+}
+
+/*
+ * Submits early to make room for needed SQEs. Without SQPOLL the kernel
+ * consumes the queue during the submit; with it, the entries only free up as
+ * the SQ thread gets to them, so we may have to wait for it.
+ * */
+void make_sq_space(unsigned needed) {
+  submit_sqes();
+  while (sqpoll_idle_ms >= 0 && io_uring_sq_space_left(&ring) < needed) {
+    int ret = io_uring_sqring_wait(&ring);
+    if (ret < 0 && ret != -EINTR) {
+      fprintf(stderr, "io_uring_sqring_wait() failed. error = %s\n",
+              strerror(-ret));
+      exit(1);
+    }
+  }
+}
+
+/*
+ * SQEs are only queued here; server_loop() submits them all at once. If a
+ * large batch of completions fills the submission queue, we flush it early.
+ * */
+struct io_uring_sqe *get_sqe() {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+  if (sqe == NULL) {
+    make_sq_space(1);
+    sqe = io_uring_get_sqe(&ring);
+  }
+
+  if (sqe == NULL) {
+    fprintf(stderr, "io_uring_get_sqe() failed.");
+    exit(EXIT_FAILURE);
+  }
+
+  return sqe;
+}
+
+struct request *alloc_request(enum event_type event_type) {
+  if (free_requests == NULL) {
+    struct request *chunk = malloc(sizeof(*chunk) * REQUEST_CHUNK_SZ);
+    request_chunks = realloc(request_chunks, sizeof(*request_chunks) *
+                                                 (request_chunk_count + 1));
+    if (chunk == NULL || request_chunks == NULL) {
+      fatal_error("malloc()");
+    }
+
+    unsigned first_id = request_chunk_count * REQUEST_CHUNK_SZ;
+    request_chunks[request_chunk_count++] = chunk;
+    for (int i = REQUEST_CHUNK_SZ - 1; i >= 0; i--) {
+      chunk[i].id = first_id + i;
+      chunk[i].next = free_requests;
+      free_requests = &chunk[i];
+    }
+  }
+
+  struct request *req = free_requests;
+  free_requests = req->next;
+
+  req->event_type = event_type;
+  req->conn = NULL;
+  req->next = NULL;
+  req->iovec_count = 0;
+  req->iov_first = 0;
+  req->cache_entry = NULL;
+  req->stream = NULL;
+  req->file = NULL;
+  return req;
+}
+
+void free_request(struct request *req) {
+  req->next = free_requests;
+  free_requests = req;
+}
+
+struct request *get_request(uint64_t id) {
+  return &request_chunks[id / REQUEST_CHUNK_SZ][id % REQUEST_CHUNK_SZ];
+}
+
+void setup_persistent_requests() {
+  accept_req = alloc_request(EVENT_TYPE_ACCEPT);
+  inotify_req = alloc_request(EVENT_TYPE_INOTIFY);
+  close_req = alloc_request(EVENT_TYPE_CLOSE);
+  timer_req = alloc_request(EVENT_TYPE_TIMER);
+  cancel_req = alloc_request(EVENT_TYPE_CANCEL);
+}
+
 /*
  * This function is responsible for setting up the main listening socket used by
- * the web server.
+ * the web server. Every worker binds its own socket to the same port with
+ * SO_REUSEPORT and the kernel spreads incoming connections across them.
  * */
 
 void setup_listening_socket() {
@@ -95,6 +604,10 @@ void setup_listening_socket() {
     fatal_error("setsockopt(SO_REUSEADDR)");
   }
 
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+    fatal_error("setsockopt(SO_REUSEPORT)");
+  }
+
   struct sockaddr_in srv_addr = {};
   srv_addr.sin_family = AF_INET;
   srv_addr.sin_port = htons(DEFAULT_SERVER_PORT);
@@ -108,7 +621,7 @@ void setup_listening_socket() {
     fatal_error("bind()");
   }
 
-  ret = listen(sock, 10);
+  ret = listen(sock, SOMAXCONN);
   if (ret < 0) {
     fatal_error("listen()");
   }
@@ -116,369 +629,3015 @@ void setup_listening_socket() {
   server_socket = sock;
 }
 
+/*
+ * Arms a multishot accept (Linux 5.19+). The kernel keeps posting one CQE per
+ * accepted connection with IORING_CQE_F_MORE set for as long as the accept
+ * stays armed, so there is no per-connection SQE, submit or allocation here.
+ * We pass no sockaddr: a single buffer would be overwritten by every accept.
+ * Use getpeername() on the client socket if the peer address is ever needed.
+ * */
 void queue_accept_request() {
-  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-  if (sqe == NULL) {
-    fprintf(stderr, "io_uring_get_sqe() failed.");
-    exit(EXIT_FAILURE);
-  }
+  struct io_uring_sqe *sqe = get_sqe();
 
-  io_uring_prep_accept(sqe, server_socket, (struct sockaddr *)&client_addr,
-                       &client_addr_len, 0);
+  io_uring_prep_multishot_accept_direct(sqe, server_socket, NULL, NULL, 0);
+  io_uring_sqe_set_data64(sqe, accept_req->id);
+}
 
-  struct request *req = malloc(sizeof(*req));
-  req->event_type = EVENT_TYPE_ACCEPT;
+/*
+ * Sizes the registered file table. Every slot counts against RLIMIT_NOFILE,
+ * which is why main() raises the soft limit as far as it goes.
+ * */
+void setup_file_table() {
+  struct rlimit rlim;
+  unsigned slots = MAX_CONNECTIONS;
+  if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < slots) {
+    slots = rlim.rlim_cur;
+  }
 
-  io_uring_sqe_set_data(sqe, req);
-  io_uring_submit(&ring);
+  int ret = io_uring_register_files_sparse(&ring, slots);
+  if (ret < 0) {
+    fprintf(stderr, "io_uring_register_files_sparse() failed. error = %s\n",
+            strerror(-ret));
+    exit(1);
+  }
 }
 
-int queue_read_request(int client_socket) {
-  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-  if (sqe == NULL) {
-    fprintf(stderr, "io_uring_get_sqe() failed.");
-    exit(EXIT_FAILURE);
+/*
+ * Finds the first byte in [p, end) that is one of the (at most 16) bytes in
+ * delims, or returns NULL. This is the inner loop of the request parser, so
+ * main() points find_delim at the widest version the CPU supports.
+ * */
+typedef const char *(*find_delim_fn)(const char *p, const char *end,
+                                     const char *delims);
+
+const char *find_delim_scalar(const char *p, const char *end,
+                              const char *delims) {
+  for (; p < end; p++) {
+    for (const char *d = delims; *d; d++) {
+      if (*p == *d) {
+        return p;
+      }
+    }
   }
 
-  struct request *req = malloc(sizeof(*req) + sizeof(req->iov[0]));
-  req->event_type = EVENT_TYPE_READ;
-  req->iov[0].iov_len = READ_SZ;
-  req->iov[0].iov_base = malloc(req->iov[0].iov_len);
-  req->client_socket = client_socket;
-
-  /* Linux kernel 5.5 has support for readv, but not for recv() or read() */
-  io_uring_prep_readv(sqe, client_socket, &req->iov[0], 1, 0);
-  io_uring_sqe_set_data(sqe, req);
-  io_uring_submit(&ring);
-  return 0;
+  return NULL;
 }
 
-int queue_write_request(struct request *req) {
-  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-  if (sqe == NULL) {
-    fprintf(stderr, "io_uring_get_sqe() failed.");
-    exit(EXIT_FAILURE);
+#if defined(__x86_64__) || defined(__i386__)
+
+/* Compares 16 bytes at a time against the whole delimiter set. */
+__attribute__((target("sse4.2"))) const char *
+find_delim_sse42(const char *p, const char *end, const char *delims) {
+  char set_bytes[16] = {0};
+  int set_len = (int)min(strlen(delims), sizeof(set_bytes));
+  memcpy(set_bytes, delims, set_len);
+  __m128i set = _mm_loadu_si128((const __m128i *)set_bytes);
+
+  for (; end - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    int i = _mm_cmpestri(set, set_len, chunk, 16,
+                         _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+                             _SIDD_LEAST_SIGNIFICANT);
+    if (i < 16) {
+      return p + i;
+    }
   }
 
-  req->event_type = EVENT_TYPE_WRITE;
-
-  io_uring_prep_writev(sqe, req->client_socket, req->iov, req->iovec_count, 0);
-  io_uring_sqe_set_data(sqe, req);
-  io_uring_submit(&ring);
-  return 0;
+  return find_delim_scalar(p, end, delims);
 }
 
-void set_iov(struct iovec *iov, const char *content) {
-  iov->iov_len = strlen(content);
-  iov->iov_base = malloc(iov->iov_len);
-  memcpy(iov->iov_base, content, iov->iov_len);
+/* Compares 32 bytes at a time, one delimiter after the other. */
+__attribute__((target("avx2"))) const char *
+find_delim_avx2(const char *p, const char *end, const char *delims) {
+  for (; end - p >= 32; p += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hits = _mm256_setzero_si256();
+    for (const char *d = delims; *d; d++) {
+      hits = _mm256_or_si256(hits,
+                             _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(*d)));
+    }
+
+    unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+
+  return find_delim_scalar(p, end, delims);
 }
 
-void send_static_string_content(const char *str, int client_socket) {
-  struct request *req = malloc(sizeof(*req) + sizeof(req->iov[0]));
+#endif
 
-  req->client_socket = client_socket;
-  req->iovec_count = 1;
-  set_iov(&req->iov[0], str);
+find_delim_fn find_delim = find_delim_scalar;
 
-  queue_write_request(req);
+const char *select_find_delim() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    find_delim = find_delim_avx2;
+    return "avx2";
+  }
+  if (__builtin_cpu_supports("sse4.2")) {
+    find_delim = find_delim_sse42;
+    return "sse4.2";
+  }
+#endif
+  return "scalar";
+}
+
+void http_parser_reset(struct http_parser *parser) {
+  parser->state = HTTP_PARSE_REQUEST_LINE;
+  parser->pos = 0;
+  parser->header_count = 0;
+}
+
+struct http_slice make_slice(const char *buf, const char *start,
+                             const char *end) {
+  struct http_slice slice = {(uint16_t)(start - buf), (uint16_t)(end - start)};
+  return slice;
 }
 
 /*
- * When ZeroHTTPd encounters any other HTTP method other than GET or POST, this
- * function is used to inform the client.
+ * Checks that the line ending at cr really ends in "\r\n". Returns 1 if it
+ * does, 0 if the '\n' hasn't arrived yet and -1 if something else follows.
  * */
+int check_crlf(const char *cr, const char *end) {
+  if (cr + 1 == end) {
+    return 0;
+  }
 
-void handle_unimplemented_method(int client_socket) {
-  send_static_string_content(unimplemented_content, client_socket);
+  return cr[1] == '\n' ? 1 : -1;
 }
 
 /*
- * This function is used to send a "HTTP Not Found" code and message to the
- * client in case the file requested is not found.
+ * Parses the request line: "GET /index.html HTTP/1.1". Returns like
+ * check_crlf().
  * */
+int parse_request_line(struct http_parser *parser, const char *buf,
+                       const char *end) {
+  const char *start = buf + parser->pos;
+  const char *delim = find_delim(start, end, " \r");
+  if (delim == NULL) {
+    return 0;
+  }
+  if (*delim != ' ' || delim == start) {
+    return -1;
+  }
+  parser->method = make_slice(buf, start, delim);
+
+  start = delim + 1;
+  delim = find_delim(start, end, " \r");
+  if (delim == NULL) {
+    return 0;
+  }
+  if (delim == start) {
+    return -1;
+  }
+  parser->path = make_slice(buf, start, delim);
+
+  start = delim;
+  if (*delim == ' ') {
+    start = delim + 1;
+    delim = find_delim(start, end, "\r");
+    if (delim == NULL) {
+      return 0;
+    }
+  }
+  parser->version = make_slice(buf, start, delim);
 
-void handle_http_404(int client_socket) {
-  send_static_string_content(http_404_content, client_socket);
+  int ret = check_crlf(delim, end);
+  if (ret > 0) {
+    parser->pos = delim + 2 - buf;
+  }
+  return ret;
 }
 
 /*
- * Once a static file is identified to be served, this function is used to read
- * the file and write it over the client socket using Linux's sendfile() system
- * call. This saves us the hassle of transferring file buffers from kernel to
- * user space and back.
+ * Parses one "Name: value" line into the header table. Returns like
+ * check_crlf().
  * */
+int parse_header_line(struct http_parser *parser, const char *buf,
+                      const char *end) {
+  const char *start = buf + parser->pos;
+  const char *colon = find_delim(start, end, ":\r");
+  if (colon == NULL) {
+    return 0;
+  }
+  if (*colon != ':' || colon == start) {
+    return -1;
+  }
 
-void copy_file_contents(char *file_path, off_t file_size, struct iovec *iov) {
-  int fd = open(file_path, O_RDONLY);
-  if (fd < 0) {
-    fprintf(stderr, "open() failed. error = %s\n", strerror(-fd));
-    exit(1);
+  const char *cr = find_delim(colon + 1, end, "\r");
+  if (cr == NULL) {
+    return 0;
+  }
+  int ret = check_crlf(cr, end);
+  if (ret <= 0) {
+    return ret;
   }
 
-  /* We should really check for short reads here */
-  iov->iov_len = file_size;
-  iov->iov_base = malloc(iov->iov_len);
+  if (parser->header_count == MAX_HEADERS) {
+    return -1;
+  }
 
-  char *buf = iov->iov_base;
-  int bytes_to_read = iov->iov_len;
+  const char *value = colon + 1;
+  const char *value_end = cr;
+  while (value < value_end && (*value == ' ' || *value == '\t')) {
+    value++;
+  }
+  while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+    value_end--;
+  }
 
-  while (true) {
-    int ret = read(fd, buf, bytes_to_read);
-    if (ret < 0) {
-      fprintf(stderr, "read() failed. error = %s\n", strerror(-ret));
-      exit(1);
+  struct http_header *header = &parser->headers[parser->header_count++];
+  header->name = make_slice(buf, start, colon);
+  header->value = make_slice(buf, value, value_end);
+  parser->pos = cr + 2 - buf;
+  return 1;
+}
+
+/*
+ * Parses as much of the request starting at buf as the len bytes we have
+ * allow, carrying on from where the previous call for the same request left
+ * off. Returns the length of the request once its blank line has been
+ * parsed, 0 if more bytes are needed and -1 if the request is malformed.
+ * */
+long http_parse(struct http_parser *parser, const char *buf, size_t len) {
+  const char *end = buf + len;
+
+  if (parser->state == HTTP_PARSE_REQUEST_LINE) {
+    int ret = parse_request_line(parser, buf, end);
+    if (ret <= 0) {
+      return ret;
     }
+    parser->state = HTTP_PARSE_HEADERS;
+  }
 
-    if (ret == bytes_to_read) {
-      break;
+  for (;;) {
+    const char *line = buf + parser->pos;
+    if (end - line < 2) {
+      return 0;
+    }
+    if (line[0] == '\r') {
+      return line[1] == '\n' ? (long)parser->pos + 2 : -1;
     }
 
-    // Short Read
-    if (ret < bytes_to_read) {
-      buf += ret;
-      bytes_to_read -= ret;
+    int ret = parse_header_line(parser, buf, end);
+    if (ret <= 0) {
+      return ret;
     }
   }
+}
+
+const char *slice_ptr(const char *buf, struct http_slice slice) {
+  return buf + slice.off;
+}
 
-  close(fd);
+/* Case-insensitive, like header names and the tokens in their values. */
+bool slice_equals(const char *buf, struct http_slice slice, const char *str) {
+  size_t len = strlen(str);
+  return slice.len == len && strncasecmp(buf + slice.off, str, len) == 0;
 }
 
 /*
- * Simple function to get the file extension of the file that we are about to
- * serve.
+ * Looks for token in a comma separated header value such as the one of
+ * "Connection: keep-alive, Upgrade".
  * */
+bool slice_has_token(const char *buf, struct http_slice slice,
+                     const char *token) {
+  const char *p = buf + slice.off;
+  const char *end = p + slice.len;
+  size_t token_len = strlen(token);
+
+  while (p < end) {
+    while (p < end && (*p == ',' || *p == ' ' || *p == '\t')) {
+      p++;
+    }
+
+    const char *start = p;
+    while (p < end && *p != ',') {
+      p++;
+    }
+
+    const char *token_end = p;
+    while (token_end > start &&
+           (token_end[-1] == ' ' || token_end[-1] == '\t')) {
+      token_end--;
+    }
+
+    if ((size_t)(token_end - start) == token_len &&
+        strncasecmp(start, token, token_len) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
 
-const char *get_filename_ext(const char *filename) {
-  const char *dot = strrchr(filename, '.');
-  if (!dot || dot == filename) {
-    return "";
+const struct http_header *find_header(const struct http_parser *parser,
+                                      const char *buf, const char *name) {
+  for (int i = 0; i < parser->header_count; i++) {
+    if (slice_equals(buf, parser->headers[i].name, name)) {
+      return &parser->headers[i];
+    }
   }
 
-  return dot + 1;
+  return NULL;
 }
 
 /*
- * Sends the HTTP 200 OK header, the server string, for a few types of files, it
- * can also send the content type based on the file extension. It also sends the
- * content length header. Finally it send a '\r\n' in a line by itself
- * signalling the end of headers and the beginning of any content.
+ * Connection timeouts. Every connection sits in one slot of a timer wheel,
+ * keyed by the second its deadline falls in, and a single timeout SQE ticks
+ * the wheel once a second. Moving a deadline is unlinking from one slot and
+ * linking into another, so it costs nothing per read or write. When a
+ * deadline passes, whatever the connection has in flight on its socket is
+ * cancelled and the completions tear the connection down.
+ *
+ * Deadlines bound how long a connection may wait for a new request, how
+ * long a request's headers may take to arrive in total (however slowly the
+ * client trickles them in) and how long a response may go without the
+ * client taking any of it.
  * */
+_Thread_local struct conn *timer_wheel[TIMER_WHEEL_SLOTS];
+_Thread_local unsigned timer_now; /* Ticks since the worker started */
 
-void prepare_headers(const char *path, off_t len, struct iovec *iov) {
-  char small_case_path[1024];
-  strcpy(small_case_path, path);
-  str_tolower(small_case_path);
+struct __kernel_timespec timer_tick = {.tv_sec = 1};
 
-  const char *str = "HTTP/1.0 200 OK\r\n";
-  set_iov(&iov[0], str);
+void queue_timer_request() {
+  struct io_uring_sqe *sqe = get_sqe();
 
-  str = "Server: zerohttpd/0.1\r\n";
-  set_iov(&iov[1], str);
+  io_uring_prep_timeout(sqe, &timer_tick, 0, 0);
+  io_uring_sqe_set_data64(sqe, timer_req->id);
+}
 
-  /*
-   * Check the file extension for certain common types of files
-   * on web pages and send the appropriate content-type header.
-   * Since extensions can be mixed case like JPG, jpg or Jpg,
-   * we turn the extension into lower case before checking.
-   * */
-  char send_buffer[1024];
-  const char *file_ext = get_filename_ext(small_case_path);
-  if (strcmp("jpg", file_ext) == 0) {
-    strcpy(send_buffer, "Content-Type: image/jpeg\r\n");
-  } else if (strcmp("jpeg", file_ext) == 0) {
-    strcpy(send_buffer, "Content-Type: image/jpeg\r\n");
-  } else if (strcmp("png", file_ext) == 0) {
-    strcpy(send_buffer, "Content-Type: image/png\r\n");
-  } else if (strcmp("gif", file_ext) == 0) {
-    strcpy(send_buffer, "Content-Type: image/gif\r\n");
-  } else if (strcmp("htm", file_ext) == 0) {
-    strcpy(send_buffer, "Content-Type: text/html\r\n");
-  } else if (strcmp("html", file_ext) == 0) {
-    strcpy(send_buffer, "Content-Type: text/html\r\n");
-  } else if (strcmp("js", file_ext) == 0) {
-    strcpy(send_buffer, "Content-Type: application/javascript\r\n");
-  } else if (strcmp("css", file_ext) == 0) {
-    strcpy(send_buffer, "Content-Type: text/css\r\n");
-  } else if (strcmp("txt", file_ext) == 0) {
-    strcpy(send_buffer, "Content-Type: text/plain\r\n");
-  } else {
-    fprintf(stderr, "Unexpected file extension = %s\n", file_ext);
-    exit(EXIT_FAILURE);
+void conn_clear_timeout(struct conn *conn) {
+  if (conn->timer_pprev != NULL) {
+    *conn->timer_pprev = conn->timer_next;
+    if (conn->timer_next != NULL) {
+      conn->timer_next->timer_pprev = conn->timer_pprev;
+    }
+    conn->timer_pprev = NULL;
   }
+}
 
-  set_iov(&iov[2], send_buffer);
+void conn_set_timeout(struct conn *conn, unsigned seconds) {
+  conn_clear_timeout(conn);
 
-  /* Send the content-length header, which is the file size in this case. */
-  sprintf(send_buffer, "content-length: %ld\r\n", len);
-  set_iov(&iov[3], send_buffer);
+  conn->deadline = timer_now + seconds;
+  struct conn **slot =
+      &timer_wheel[conn->deadline & (TIMER_WHEEL_SLOTS - 1)];
+  conn->timer_next = *slot;
+  if (*slot != NULL) {
+    (*slot)->timer_pprev = &conn->timer_next;
+  }
+  conn->timer_pprev = slot;
+  *slot = conn;
+}
 
-  /*
+/*
+ * Cancels every operation in flight on the connection's socket. An operation
+ * that is still waiting for an earlier linked one (or for its file to be
+ * read) can't be cancelled yet, so we try again on the next tick until the
+ * connection is gone.
+ * */
+void expire_conn(struct conn *conn) {
+  conn->timed_out = true;
+  conn_set_timeout(conn, 1);
+
+  struct io_uring_sqe *sqe = get_sqe();
+  io_uring_prep_cancel_fd(sqe, conn->client_socket,
+                          IORING_ASYNC_CANCEL_ALL |
+                              IORING_ASYNC_CANCEL_FD_FIXED);
+  io_uring_sqe_set_data64(sqe, cancel_req->id);
+}
+
+void handle_timer_tick() {
+  timer_now++;
+  if (timer_now % STATS_INTERVAL_SEC == 0) {
+    report_errors();
+    report_sqpoll();
+  }
+
+  struct conn *conn = timer_wheel[timer_now & (TIMER_WHEEL_SLOTS - 1)];
+  while (conn != NULL) {
+    struct conn *next = conn->timer_next;
+    if (conn->deadline == timer_now) {
+      expire_conn(conn);
+    }
+    conn = next;
+  }
+
+  queue_timer_request();
+}
+
+/* Returns NULL if we are out of memory. */
+struct conn *create_conn(int client_socket) {
+  struct conn *conn = malloc(sizeof(*conn));
+  if (conn == NULL) {
+    return NULL;
+  }
+
+  conn->client_socket = client_socket;
+  conn->state = CONN_STATE_READING;
+  conn->keep_alive = true;
+  conn->write_head = NULL;
+  conn->write_tail = NULL;
+  conn->partial = NULL;
+  conn->partial_len = 0;
+  http_parser_reset(&conn->parser);
+  conn->timer_pprev = NULL;
+  conn->timed_out = false;
+  conn_set_timeout(conn, IDLE_TIMEOUT_SEC);
+  return conn;
+}
+
+/*
+ * Closes a descriptor without blocking the event loop.
+ * */
+void queue_close_request(int fd) {
+  struct io_uring_sqe *sqe = get_sqe();
+
+  io_uring_prep_close(sqe, fd);
+  io_uring_sqe_set_data64(sqe, close_req->id);
+}
+
+/* The same for a client socket, which lives in the registered file table. */
+void queue_close_direct_request(int slot) {
+  struct io_uring_sqe *sqe = get_sqe();
+
+  io_uring_prep_close_direct(sqe, slot);
+  io_uring_sqe_set_data64(sqe, close_req->id);
+}
+
+void close_conn(struct conn *conn) {
+  queue_close_direct_request(conn->client_socket);
+  conn_clear_timeout(conn);
+  free(conn->partial);
+  free(conn);
+
+  /* The close frees up a slot, so a paused accept can go again. */
+  if (accept_paused) {
+    accept_paused = false;
+    queue_accept_request();
+  }
+}
+
+char *get_buffer(unsigned short bid) {
+  return buf_ring_pool + (size_t)bid * READ_SZ;
+}
+
+/*
+ * Registers the provided-buffer ring (Linux 5.19+) and hands every buffer in
+ * the pool to the kernel.
+ * */
+void setup_buffer_ring() {
+  int ret;
+  buf_ring = io_uring_setup_buf_ring(&ring, BUF_RING_ENTRIES, BUF_GROUP_ID, 0,
+                                     &ret);
+  if (buf_ring == NULL) {
+    fprintf(stderr, "io_uring_setup_buf_ring() failed. error = %s\n",
+            strerror(-ret));
+    exit(1);
+  }
+
+  buf_ring_pool = malloc((size_t)BUF_RING_ENTRIES * READ_SZ);
+  if (buf_ring_pool == NULL) {
+    fatal_error("malloc()");
+  }
+
+  int mask = io_uring_buf_ring_mask(BUF_RING_ENTRIES);
+  for (int i = 0; i < BUF_RING_ENTRIES; i++) {
+    io_uring_buf_ring_add(buf_ring, get_buffer(i), READ_SZ, i, mask, i);
+  }
+  io_uring_buf_ring_advance(buf_ring, BUF_RING_ENTRIES);
+}
+
+/* Gives a buffer back to the kernel once we are done parsing it. */
+void recycle_buffer(unsigned short bid) {
+  io_uring_buf_ring_add(buf_ring, get_buffer(bid), READ_SZ, bid,
+                        io_uring_buf_ring_mask(BUF_RING_ENTRIES), 0);
+  io_uring_buf_ring_advance(buf_ring, 1);
+}
+
+/*
+ * Zero-copy sends (-z, Linux 6.0+). A regular write copies the response body
+ * into socket buffers; IORING_OP_SEND_ZC instead has the network stack
+ * reference our pages directly. Cached bodies of at least ZEROCOPY_MIN_SZ
+ * bytes are registered with the ring, which pins them once instead of on
+ * every send. Below that size, pinning and the extra notification cost more
+ * than the copy and we keep using writev.
+ *
+ * The kernel may still read a body after the send completes, until it posts
+ * a separate notification CQE (IORING_CQE_F_NOTIF). Each zero-copy send
+ * therefore holds a reference on its cache entry until that notification,
+ * and the buffer is only unregistered and freed after the last one.
+ * */
+bool zerocopy_enabled;
+_Thread_local int zerocopy_free_slots[ZEROCOPY_BUFFERS];
+_Thread_local int zerocopy_free_count;
+
+void setup_zerocopy() {
+  if (!zerocopy_enabled) {
+    return;
+  }
+
+  struct io_uring_probe *probe = io_uring_get_probe_ring(&ring);
+  bool supported =
+      probe != NULL && io_uring_opcode_supported(probe, IORING_OP_SEND_ZC);
+  io_uring_free_probe(probe);
+  if (!supported) {
+    fprintf(stderr, "Zero-copy send is not supported, using writev\n");
+    return;
+  }
+
+  int ret = io_uring_register_buffers_sparse(&ring, ZEROCOPY_BUFFERS);
+  if (ret < 0) {
+    fprintf(stderr, "io_uring_register_buffers_sparse() failed. error = %s\n",
+            strerror(-ret));
+    return;
+  }
+
+  for (int i = 0; i < ZEROCOPY_BUFFERS; i++) {
+    zerocopy_free_slots[i] = ZEROCOPY_BUFFERS - 1 - i;
+  }
+  zerocopy_free_count = ZEROCOPY_BUFFERS;
+}
+
+/*
+ * Registers a body for zero-copy sends. Returns its buffer index, or -1 if
+ * it should be sent with writev: it is too small, zero-copy is off or every
+ * slot is taken.
+ * */
+int register_zerocopy_buffer(void *body, size_t size) {
+  if (size < ZEROCOPY_MIN_SZ || zerocopy_free_count == 0) {
+    return -1;
+  }
+
+  int slot = zerocopy_free_slots[--zerocopy_free_count];
+  struct iovec iov = {.iov_base = body, .iov_len = size};
+  int ret = io_uring_register_buffers_update_tag(&ring, slot, &iov, NULL, 1);
+  if (ret < 0) {
+    /* Usually ENOMEM from RLIMIT_MEMLOCK. */
+    count_error(-ret);
+    zerocopy_free_slots[zerocopy_free_count++] = slot;
+    return -1;
+  }
+
+  return slot;
+}
+
+void unregister_zerocopy_buffer(int slot) {
+  struct iovec iov = {.iov_base = NULL, .iov_len = 0};
+  io_uring_register_buffers_update_tag(&ring, slot, &iov, NULL, 1);
+  zerocopy_free_slots[zerocopy_free_count++] = slot;
+}
+
+int queue_read_request(struct conn *conn) {
+  struct io_uring_sqe *sqe = get_sqe();
+
+  struct request *req = alloc_request(EVENT_TYPE_READ);
+  req->conn = conn;
+  conn->state = CONN_STATE_READING;
+
+  /* A started request keeps the deadline it got when it started. */
+  if (conn->partial == NULL) {
+    conn_set_timeout(conn, IDLE_TIMEOUT_SEC);
+  }
+
+  /* No buffer here: the kernel selects one from BUF_GROUP_ID on arrival. */
+  io_uring_prep_recv(sqe, conn->client_socket, NULL, READ_SZ, 0);
+  sqe->flags |= IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUF_GROUP_ID;
+  io_uring_sqe_set_data64(sqe, req->id);
+  return 0;
+}
+
+/*
+ * Sends the rest of the body of a response with a registered body, see
+ * setup_zerocopy(). The send gets a request of its own because it outlives
+ * the response: its user_data comes back once more with the notification.
+ * */
+void queue_zerocopy_send(struct request *head) {
+  struct io_uring_sqe *sqe = get_sqe();
+  struct iovec *body = &head->iov[head->iovec_count - 1];
+
+  struct request *req = alloc_request(EVENT_TYPE_SEND_ZC);
+  req->conn = head->conn;
+  req->cache_entry = head->cache_entry;
+  req->cache_entry->refcount++;
+
+  io_uring_prep_send_zc_fixed(sqe, head->conn->client_socket, body->iov_base,
+                              body->iov_len, MSG_NOSIGNAL, 0,
+                              head->cache_entry->buf_index);
+  sqe->flags |= IOSQE_FIXED_FILE;
+  io_uring_sqe_set_data64(sqe, req->id);
+}
+
+/*
+ * Writes whatever is left of a response. The body of a registered cache
+ * entry is the last iovec and goes out with a zero-copy send once everything
+ * before it has been written.
+ * */
+void submit_write_request(struct request *req) {
+  int count = req->iovec_count - req->iov_first;
+  if (req->cache_entry != NULL && req->cache_entry->buf_index >= 0) {
+    if (count == 1) {
+      queue_zerocopy_send(req);
+      return;
+    }
+    count--;
+  }
+
+  struct io_uring_sqe *sqe = get_sqe();
+  io_uring_prep_writev(sqe, req->conn->client_socket,
+                       &req->iov[req->iov_first], count, 0);
+  sqe->flags |= IOSQE_FIXED_FILE;
+  io_uring_sqe_set_data64(sqe, req->id);
+}
+
+/*
+ * Queues a response on its connection. Only the response at the head of the
+ * queue is ever in flight, so pipelined responses can't overtake each other.
+ * A response whose file is still being opened or read keeps its place in the
+ * queue until mark_write_request_ready() is called for it.
+ * */
+void enqueue_write_request(struct request *req) {
+  struct conn *conn = req->conn;
+
+  req->next = NULL;
+  req->iov_first = 0;
+
+  if (conn->write_tail != NULL) {
+    conn->write_tail->next = req;
+    conn->write_tail = req;
+    return;
+  }
+
+  conn->write_head = req;
+  conn->write_tail = req;
+  conn->state = CONN_STATE_WRITING;
+  conn_set_timeout(conn, WRITE_TIMEOUT_SEC);
+  if (req->event_type == EVENT_TYPE_WRITE) {
+    submit_write_request(req);
+  }
+}
+
+int queue_write_request(struct request *req) {
+  req->event_type = EVENT_TYPE_WRITE;
+  enqueue_write_request(req);
+  return 0;
+}
+
+void mark_write_request_ready(struct request *req) {
+  req->event_type = EVENT_TYPE_WRITE;
+  if (req->conn->write_head == req) {
+    submit_write_request(req);
+  }
+}
+
+/*
+ * Skips over the first "written" bytes of a response after a (possibly short)
+ * write. Returns true once the whole response has been written.
+ * */
+bool advance_write_request(struct request *req, size_t written) {
+  while (req->iov_first < req->iovec_count) {
+    struct iovec *iov = &req->iov[req->iov_first];
+    if (written < iov->iov_len) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+      return false;
+    }
+
+    written -= iov->iov_len;
+    req->iov_first++;
+  }
+
+  return true;
+}
+
+/*
+ * Points an iovec at a string that outlives the write, without copying it.
+ * */
+void set_iov(struct iovec *iov, const char *content) {
+  iov->iov_len = strlen(content);
+  iov->iov_base = (void *)content;
+}
+
+/*
+ * Content types, keyed by file extension. The list is built into the server
+ * and can be extended (or overridden) with a mime.types style file passed
+ * with -m. Every type carries its ready-made "Content-Type: " header line,
+ * which responses point at instead of formatting it.
+ *
+ * Once loaded, the extensions are put in a perfect hash table using "hash
+ * and displace": extensions are first hashed into buckets, then for every
+ * bucket, biggest first, we look for a seed that hashes all of its
+ * extensions into free slots. A lookup is then two hashes and one compare.
+ * The table is built before the workers start and only read afterwards.
+ * */
+struct mime_type {
+  char *ext; /* Lower case, without the dot */
+  size_t ext_len;
+  unsigned seq; /* Later definitions of an extension win */
+  struct iovec header;
+  bool compressible; /* Worth looking for precompressed sidecars */
+};
+
+#define CONTENT_TYPE_HEADER(type)                                              \
+  {.iov_base = "Content-Type: " type "\r\n",                                   \
+   .iov_len = sizeof("Content-Type: " type "\r\n") - 1}
+
+struct mime_type html_mime_type = {.header = CONTENT_TYPE_HEADER("text/html"),
+                                   .compressible = true};
+struct mime_type default_mime_type = {
+    .header = CONTENT_TYPE_HEADER("application/octet-stream")};
+
+const char *builtin_mime_types[] = {
+    "image/jpeg jpg jpeg",
+    "image/png png",
+    "image/gif gif",
+    "text/html htm html",
+    "application/javascript js",
+    "text/css css",
+    "text/plain txt",
+    NULL,
+};
+
+/*
+ * Text, and the structured formats that are text in disguise. Images other
+ * than SVG, audio, video and archives are compressed already.
+ * */
+bool is_compressible_type(const char *type) {
+  size_t len = strlen(type);
+  return strncasecmp(type, "text/", 5) == 0 ||
+         strcasecmp(type, "application/javascript") == 0 ||
+         strcasecmp(type, "application/json") == 0 ||
+         strcasecmp(type, "application/xml") == 0 ||
+         (len > 4 && strcasecmp(type + len - 4, "+xml") == 0) ||
+         (len > 5 && strcasecmp(type + len - 5, "+json") == 0);
+}
+
+struct mime_type *mime_types;
+unsigned mime_type_count;
+struct mime_type **mime_slots; /* mime_slot_count entries, a power of 2 */
+unsigned mime_slot_count;
+unsigned *mime_seeds; /* One per bucket */
+unsigned mime_bucket_count;
+
+/* FNV-1a over the lower cased extension, finished off with murmur3's fmix. */
+unsigned mime_hash(const char *ext, size_t len, unsigned seed) {
+  unsigned hash = 2166136261u ^ seed;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)tolower((unsigned char)ext[i])) * 16777619u;
+  }
+
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+/*
+ * Adds every extension on a mime.types line: "text/html html htm".
+ * */
+void add_mime_types(const char *line) {
+  char *copy = strdup(line);
+  char *save_ptr;
+  char *type = strtok_r(copy, " \t\r\n", &save_ptr);
+  if (type == NULL || type[0] == '#') {
+    free(copy);
+    return;
+  }
+
+  char *header;
+  if (asprintf(&header, "Content-Type: %s\r\n", type) < 0) {
+    fatal_error("asprintf()");
+  }
+
+  char *ext;
+  while ((ext = strtok_r(NULL, " \t\r\n", &save_ptr)) != NULL) {
+    mime_types =
+        realloc(mime_types, sizeof(*mime_types) * (mime_type_count + 1));
+    if (mime_types == NULL) {
+      fatal_error("realloc()");
+    }
+
+    struct mime_type *mime = &mime_types[mime_type_count];
+    mime->ext = strdup(ext);
+    mime->ext_len = strlen(ext);
+    for (char *c = mime->ext; *c; c++) {
+      *c = (char)tolower((unsigned char)*c);
+    }
+    mime->seq = mime_type_count++;
+    mime->header.iov_base = header; /* Shared by the type's extensions */
+    mime->header.iov_len = strlen(header);
+    mime->compressible = is_compressible_type(type);
+  }
+
+  free(copy);
+}
+
+void load_mime_types(const char *filename) {
+  FILE *file = fopen(filename, "r");
+  if (file == NULL) {
+    fatal_error(filename);
+  }
+
+  char *line = NULL;
+  size_t line_sz = 0;
+  while (getline(&line, &line_sz, file) != -1) {
+    add_mime_types(line);
+  }
+
+  free(line);
+  fclose(file);
+}
+
+int compare_mime_types(const void *a, const void *b) {
+  const struct mime_type *x = a;
+  const struct mime_type *y = b;
+  int ret = strcmp(x->ext, y->ext);
+  if (ret != 0) {
+    return ret;
+  }
+
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+struct mime_bucket {
+  unsigned index;
+  unsigned size;
+  struct mime_type **types;
+};
+
+int compare_mime_buckets(const void *a, const void *b) {
+  const struct mime_bucket *x = a;
+  const struct mime_bucket *y = b;
+  return x->size < y->size ? 1 : x->size > y->size ? -1 : 0;
+}
+
+/*
+ * Drops duplicate extensions, keeping the last definition, then builds the
+ * perfect hash table described above.
+ * */
+void build_mime_table() {
+  qsort(mime_types, mime_type_count, sizeof(*mime_types), compare_mime_types);
+  unsigned count = 0;
+  for (unsigned i = 0; i < mime_type_count; i++) {
+    if (count > 0 &&
+        strcmp(mime_types[count - 1].ext, mime_types[i].ext) == 0) {
+      free(mime_types[count - 1].ext);
+      count--;
+    }
+    mime_types[count++] = mime_types[i];
+  }
+  mime_type_count = count;
+
+  mime_slot_count = 1;
+  while (mime_slot_count < mime_type_count * 2) {
+    mime_slot_count <<= 1;
+  }
+  mime_bucket_count = mime_type_count / 4 + 1;
+  mime_slots = calloc(mime_slot_count, sizeof(*mime_slots));
+  mime_seeds = calloc(mime_bucket_count, sizeof(*mime_seeds));
+  struct mime_bucket *buckets = calloc(mime_bucket_count, sizeof(*buckets));
+  if (mime_slots == NULL || mime_seeds == NULL || buckets == NULL) {
+    fatal_error("calloc()");
+  }
+
+  for (unsigned i = 0; i < mime_bucket_count; i++) {
+    buckets[i].index = i;
+    buckets[i].types = malloc(sizeof(*buckets[i].types) * mime_type_count);
+  }
+  for (unsigned i = 0; i < mime_type_count; i++) {
+    struct mime_type *mime = &mime_types[i];
+    struct mime_bucket *bucket =
+        &buckets[mime_hash(mime->ext, mime->ext_len, 0) % mime_bucket_count];
+    bucket->types[bucket->size++] = mime;
+  }
+  qsort(buckets, mime_bucket_count, sizeof(*buckets), compare_mime_buckets);
+
+  unsigned mask = mime_slot_count - 1;
+  for (unsigned i = 0; i < mime_bucket_count && buckets[i].size > 0; i++) {
+    struct mime_bucket *bucket = &buckets[i];
+    unsigned seed = 0;
+    unsigned placed = 0;
+    while (placed < bucket->size) {
+      seed++;
+      for (placed = 0; placed < bucket->size; placed++) {
+        struct mime_type *mime = bucket->types[placed];
+        unsigned slot = mime_hash(mime->ext, mime->ext_len, seed) & mask;
+        if (mime_slots[slot] != NULL) {
+          break;
+        }
+        mime_slots[slot] = mime;
+      }
+
+      /* Undo a partial placement before trying the next seed. */
+      if (placed < bucket->size) {
+        for (unsigned j = 0; j < placed; j++) {
+          struct mime_type *mime = bucket->types[j];
+          mime_slots[mime_hash(mime->ext, mime->ext_len, seed) & mask] = NULL;
+        }
+      }
+    }
+    mime_seeds[bucket->index] = seed;
+  }
+
+  for (unsigned i = 0; i < mime_bucket_count; i++) {
+    free(buckets[i].types);
+  }
+  free(buckets);
+}
+
+void setup_mime_types(const char *filename) {
+  for (const char **line = builtin_mime_types; *line; line++) {
+    add_mime_types(*line);
+  }
+  if (filename != NULL) {
+    load_mime_types(filename);
+  }
+
+  build_mime_table();
+}
+
+/*
+ * Returns the content type for a path by its extension, in any case.
+ * Anything we don't know is sent as application/octet-stream.
+ * */
+
+const struct mime_type *get_content_type(const char *path) {
+  const char *dot = strrchr(path, '.');
+  if (dot == NULL || strchr(dot, '/') != NULL) {
+    return &default_mime_type;
+  }
+
+  const char *ext = dot + 1;
+  size_t len = strlen(ext);
+  unsigned bucket = mime_hash(ext, len, 0) % mime_bucket_count;
+  unsigned slot =
+      mime_hash(ext, len, mime_seeds[bucket]) & (mime_slot_count - 1);
+  const struct mime_type *mime = mime_slots[slot];
+  if (mime != NULL && mime->ext_len == len &&
+      strncasecmp(mime->ext, ext, len) == 0) {
+    return mime;
+  }
+
+  return &default_mime_type;
+}
+
+/*
+ * The Content-Encoding and Vary lines of a file response, if any.
+ * */
+const char *encoding_headers(const struct mime_type *content_type,
+                             enum content_encoding encoding) {
+  if (encoding == ENCODING_IDENTITY && !content_type->compressible) {
+    return NULL;
+  }
+
+  return encodings[encoding].headers;
+}
+
+/*
+ * Sends the HTTP status line, the server string, the content type and the
+ * content length header, followed by validators, encoding and range_line
+ * (each if not NULL) and whether the connection stays open. Finally it send
+ * a '\r\n' in a line by itself signalling the end of headers and the
+ * beginning of any content. Fills HEADER_IOVEC_COUNT iovecs. All of them
+ * point at shared, static lines except for the content length, which is
+ * formatted into buf, validators and range_line. buf holds HEADER_BUF_SZ
+ * bytes and all of them must live as long as the iovecs.
+ * */
+
+void prepare_headers(const char *status_line,
+                     const struct mime_type *content_type, off_t len,
+                     const char *validators, const char *encoding,
+                     const char *range_line, bool keep_alive,
+                     struct iovec *iov, char *buf) {
+  set_iov(&iov[0], status_line);
+
+  const char *str = "Server: zerohttpd/0.1\r\n";
+  set_iov(&iov[1], str);
+
+  iov[2] = content_type->header;
+
+  /* Send the content-length header, which is the file size in this case. */
+  iov[3].iov_base = buf;
+  iov[3].iov_len = snprintf(buf, HEADER_BUF_SZ, "content-length: %ld\r\n", len);
+
+  set_iov(&iov[4], validators != NULL ? validators : "");
+  set_iov(&iov[5], encoding != NULL ? encoding : "");
+  set_iov(&iov[6], range_line != NULL ? range_line : "");
+
+  /*
+   * A persistent connection is the default in HTTP/1.1, but saying so
+   * explicitly also keeps HTTP/1.0 clients that asked for it happy.
+   * */
+  str = keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+  set_iov(&iov[7], str);
+
+  /*
    * When the browser sees a '\r\n' sequence in a line on its own,
    * it understands there are no more headers. Content may follow.
    * */
   str = "\r\n";
-  set_iov(&iov[4], str);
+  set_iov(&iov[8], str);
+}
+
+/*
+ * Fills a response that has room for HEADER_IOVEC_COUNT + 1 iovecs.
+ * */
+void fill_static_string_content(struct request *req, const char *status_line,
+                                const char *str, const char *range_line,
+                                bool keep_alive) {
+  req->cache_entry = NULL;
+  req->stream = NULL;
+  req->iovec_count = HEADER_IOVEC_COUNT + 1;
+  prepare_headers(status_line, &html_mime_type, strlen(str), NULL, NULL,
+                  range_line, keep_alive, req->iov, req->header_buf);
+  set_iov(&req->iov[HEADER_IOVEC_COUNT], str);
+}
+
+void send_static_string_content(const char *status_line, const char *str,
+                                struct conn *conn) {
+  struct request *req = alloc_request(EVENT_TYPE_WRITE);
+  req->conn = conn;
+  fill_static_string_content(req, status_line, str, NULL, conn->keep_alive);
+  queue_write_request(req);
+}
+
+/*
+ * Validators. Every file response carries an ETag and a Last-Modified date,
+ * both derived from the statx() data we have anyway: the ETag is the
+ * modification time in nanoseconds and the size, so it changes whenever the
+ * file does. A client revalidating its copy with If-None-Match or
+ * If-Modified-Since gets a 304 without a body, answered from the cache or
+ * from a statx() of the path, without ever opening the file.
+ * */
+
+/* Formats an IMF-fixdate into buf, which holds HTTP_DATE_SZ bytes. */
+void format_http_date(time_t time, char *buf) {
+  struct tm tm;
+  gmtime_r(&time, &tm);
+  strftime(buf, HTTP_DATE_SZ, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/* Parses an IMF-fixdate. Returns -1 for anything else. */
+time_t parse_http_date(const char *str) {
+  struct tm tm = {};
+  const char *end = strptime(str, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL || *end != '\0') {
+    return -1;
+  }
+
+  return timegm(&tm);
+}
+
+/* Formats the quoted ETag into buf, which holds ETAG_SZ bytes. */
+void format_etag(struct timespec mtime, off_t size, char *buf) {
+  snprintf(buf, ETAG_SZ, "\"%lx.%lx-%lx\"", (unsigned long)mtime.tv_sec,
+           (unsigned long)mtime.tv_nsec, (unsigned long)size);
+}
+
+/*
+ * Formats the ETag and Last-Modified lines into buf, which holds
+ * VALIDATORS_BUF_SZ bytes, and returns it.
+ * */
+char *format_validators(struct timespec mtime, off_t size, char *buf) {
+  char etag[ETAG_SZ];
+  char date[HTTP_DATE_SZ];
+  format_etag(mtime, size, etag);
+  format_http_date(mtime.tv_sec, date);
+  snprintf(buf, VALIDATORS_BUF_SZ, "ETag: %s\r\nLast-Modified: %s\r\n", etag,
+           date);
+  return buf;
+}
+
+/*
+ * Looks for etag in an If-None-Match list. The comparison is weak, as it
+ * should be for If-None-Match: a "W/" prefix doesn't matter.
+ * */
+bool etag_list_matches(const char *list, const char *etag) {
+  size_t etag_len = strlen(etag);
+  const char *p = list;
+
+  while (*p != '\0') {
+    while (*p == ',' || *p == ' ' || *p == '\t') {
+      p++;
+    }
+    if (*p == '*') {
+      return true;
+    }
+    if (strncmp(p, "W/", 2) == 0) {
+      p += 2;
+    }
+    if (strncmp(p, etag, etag_len) == 0 &&
+        (p[etag_len] == '\0' || p[etag_len] == ',' || p[etag_len] == ' ' ||
+         p[etag_len] == '\t')) {
+      return true;
+    }
+
+    while (*p != '\0' && *p != ',') {
+      p++;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * Whether the client's copy is still current. If-Modified-Since only counts
+ * without If-None-Match, which is the more precise of the two.
+ * */
+bool is_not_modified(const struct preconditions *preconditions,
+                     struct timespec mtime, off_t size) {
+  if (preconditions->if_none_match[0] != '\0') {
+    char etag[ETAG_SZ];
+    format_etag(mtime, size, etag);
+    return etag_list_matches(preconditions->if_none_match, etag);
+  }
+
+  return preconditions->if_modified_since >= 0 &&
+         mtime.tv_sec <= preconditions->if_modified_since;
+}
+
+bool is_conditional(const struct preconditions *preconditions) {
+  return preconditions->if_none_match[0] != '\0' ||
+         preconditions->if_modified_since >= 0;
+}
+
+/*
+ * A 304 has the headers the 200 would have had, content-length included,
+ * but no body.
+ * */
+void fill_not_modified(struct request *req,
+                       const struct mime_type *content_type,
+                       enum content_encoding encoding, struct timespec mtime,
+                       off_t size, bool keep_alive) {
+  req->cache_entry = NULL;
+  req->stream = NULL;
+  req->iovec_count = HEADER_IOVEC_COUNT;
+  prepare_headers("HTTP/1.1 304 Not Modified\r\n", content_type, size,
+                  format_validators(mtime, size, req->validators_buf),
+                  encoding_headers(content_type, encoding), NULL, keep_alive,
+                  req->iov, req->header_buf);
+}
+
+/*
+ * Range requests. Files are served whole with "Accept-Ranges: bytes" and
+ * a Range header turns the response into a 206 carrying just that part: a
+ * slice of the cached body, or a stream that starts splicing at the first
+ * byte of the range. A range that starts past the end of the file gets a
+ * 416. With If-Range, the range only applies if the file is still the one
+ * the client has part of, otherwise it gets all of it again.
+ * */
+
+const char *accept_ranges_line = "Accept-Ranges: bytes\r\n";
+
+enum range_result {
+  RANGE_FULL, /* No (usable) range, send the whole file */
+  RANGE_PARTIAL,
+  RANGE_NOT_SATISFIABLE,
+};
+
+/*
+ * If-Range needs a strong match: the file's exact ETag (a weak "W/" one
+ * never matches) or exactly its modification time as a date.
+ * */
+bool if_range_matches(const struct byte_range *range, struct timespec mtime,
+                      off_t size) {
+  if (range->if_range[0] == '\0') {
+    return true;
+  }
+
+  if (range->if_range[0] == '"') {
+    char etag[ETAG_SZ];
+    format_etag(mtime, size, etag);
+    return strcmp(range->if_range, etag) == 0;
+  }
+
+  char date[HTTP_DATE_SZ];
+  format_http_date(mtime.tv_sec, date);
+  return strcmp(range->if_range, date) == 0;
+}
+
+/*
+ * Checks a requested range against the file it is for. For RANGE_PARTIAL,
+ * first and len are set to the bytes to send.
+ * */
+enum range_result resolve_range(const struct byte_range *range, off_t size,
+                                struct timespec mtime, off_t *first,
+                                off_t *len) {
+  if (!range->requested || !if_range_matches(range, mtime, size)) {
+    return RANGE_FULL;
+  }
+
+  if (range->first < 0) {
+    if (range->last == 0 || size == 0) {
+      return RANGE_NOT_SATISFIABLE;
+    }
+    *len = min(range->last, size);
+    *first = size - *len;
+    return RANGE_PARTIAL;
+  }
+
+  if (range->first >= size) {
+    return RANGE_NOT_SATISFIABLE;
+  }
+
+  off_t last = range->last < 0 || range->last >= size ? size - 1 : range->last;
+  *first = range->first;
+  *len = last - range->first + 1;
+  return RANGE_PARTIAL;
+}
+
+/* Formats the Content-Range line of a 206 into the response. */
+const char *format_content_range(struct request *req, off_t first, off_t len,
+                                 off_t size) {
+  snprintf(req->range_buf, RANGE_BUF_SZ, "Content-Range: bytes %ld-%ld/%ld\r\n",
+           first, first + len - 1, size);
+  return req->range_buf;
+}
+
+void fill_range_not_satisfiable(struct request *req, off_t size,
+                                bool keep_alive) {
+  snprintf(req->range_buf, RANGE_BUF_SZ, "Content-Range: bytes */%ld\r\n",
+           size);
+  fill_static_string_content(req, "HTTP/1.1 416 Range Not Satisfiable\r\n",
+                             http_416_content, req->range_buf, keep_alive);
+}
+
+/*
+ * When ZeroHTTPd encounters any other HTTP method other than GET or POST, this
+ * function is used to inform the client.
+ * */
+
+void handle_unimplemented_method(struct conn *conn) {
+  send_static_string_content("HTTP/1.1 400 Bad Request\r\n",
+                             unimplemented_content, conn);
+}
+
+/*
+ * This function is used to send a "HTTP Not Found" code and message to the
+ * client in case the file requested is not found.
+ * */
+
+void handle_http_404(struct conn *conn) {
+  send_static_string_content("HTTP/1.1 404 Not Found\r\n", http_404_content,
+                             conn);
+}
+
+/*
+ * Files that don't fit in the cache are streamed instead of read into memory:
+ * the kernel splices them from the file into a pipe and from the pipe into
+ * the socket, SPLICE_CHUNK_SZ bytes at a time, without the data ever
+ * reaching user space. Memory per download is the pipe buffer, no matter how
+ * big the file is, and the disk reads happen in io_uring, not in our loop.
+ * */
+
+struct file_stream *create_file_stream(int file_fd, off_t offset,
+                                       off_t size) {
+  struct file_stream *stream = malloc(sizeof(*stream));
+  if (stream == NULL) {
+    return NULL;
+  }
+
+  if (pipe2(stream->pipe_fds, O_CLOEXEC) < 0) {
+    free(stream);
+    return NULL;
+  }
+
+  /* Let a whole chunk fit in the pipe. If this fails, splices just get short. */
+  fcntl(stream->pipe_fds[1], F_SETPIPE_SZ, SPLICE_CHUNK_SZ);
+
+  stream->file_fd = file_fd;
+  stream->offset = offset;
+  stream->remaining = size;
+  stream->in_pipe = 0;
+  stream->inflight = 0;
+  stream->truncated = false;
+  stream->failed = false;
+  return stream;
+}
+
+void free_file_stream(struct file_stream *stream) {
+  queue_close_request(stream->file_fd);
+  queue_close_request(stream->pipe_fds[0]);
+  queue_close_request(stream->pipe_fds[1]);
+  free(stream);
+}
+
+void queue_splice_request(struct conn *conn, enum event_type event_type,
+                          int fd_in, int64_t off_in, int fd_out, size_t len,
+                          unsigned flags) {
+  struct io_uring_sqe *sqe = get_sqe();
+
+  struct request *req = alloc_request(event_type);
+  req->conn = conn;
+
+  io_uring_prep_splice(sqe, fd_in, off_in, fd_out, -1, len, 0);
+  sqe->flags |= flags;
+  io_uring_sqe_set_data64(sqe, req->id);
+}
+
+/*
+ * Moves the next chunk of the response at the head of the connection's write
+ * queue. Normally that is a file -> pipe splice linked to a pipe -> socket
+ * splice, so the kernel starts sending as soon as the data is in the pipe.
+ * If the socket took less than we had last time, only the bytes still in the
+ * pipe are sent.
+ * */
+
+void queue_stream_chunk(struct conn *conn) {
+  struct file_stream *stream = conn->write_head->stream;
+  int client_socket = conn->client_socket;
+
+  if (stream->in_pipe > 0) {
+    queue_splice_request(conn, EVENT_TYPE_SPLICE_OUT, stream->pipe_fds[0], -1,
+                         client_socket, stream->in_pipe, IOSQE_FIXED_FILE);
+    stream->inflight = 1;
+  } else {
+    /* Both halves of the link have to go out in the same submission. */
+    if (io_uring_sq_space_left(&ring) < 2) {
+      make_sq_space(2);
+    }
+
+    size_t chunk = min(stream->remaining, SPLICE_CHUNK_SZ);
+    queue_splice_request(conn, EVENT_TYPE_SPLICE_IN, stream->file_fd,
+                         stream->offset, stream->pipe_fds[1], chunk,
+                         IOSQE_IO_LINK);
+    queue_splice_request(conn, EVENT_TYPE_SPLICE_OUT, stream->pipe_fds[0], -1,
+                         client_socket, chunk, IOSQE_FIXED_FILE);
+    stream->inflight = 2;
+  }
+}
+
+/*
+ * FNV-1a. Paths are short, so this is plenty fast and spreads well enough.
+ * */
+
+unsigned hash_path(const char *path) {
+  unsigned hash = 2166136261u;
+  for (; *path; ++path) {
+    hash = (hash ^ (unsigned char)*path) * 16777619u;
+  }
+  return hash;
+}
+
+void cache_entry_put(struct cache_entry *entry) {
+  if (--entry->refcount > 0) {
+    return;
+  }
+
+  /* No zero-copy send can still be reading the body, see setup_zerocopy(). */
+  if (entry->buf_index >= 0) {
+    unregister_zerocopy_buffer(entry->buf_index);
+  }
+
+  free(entry->headers[0].iov_base);
+  free(entry->headers[1].iov_base);
+  free(entry->body.iov_base);
+  free(entry->path);
+  free(entry);
+}
+
+void cache_remove(struct cache_entry **link) {
+  struct cache_entry *entry = *link;
+  *link = entry->next;
+  cache_total_sz -= entry->size;
+  cache_entry_put(entry);
+}
+
+/*
+ * Drops every entry served from the file behind an inotify watch. Different
+ * request paths for the same file share the watch, so there can be several.
+ * */
+
+void cache_invalidate_wd(int wd) {
+  for (int i = 0; i < CACHE_BUCKETS; i++) {
+    struct cache_entry **link = &cache[i];
+    while (*link != NULL) {
+      if ((*link)->wd == wd) {
+        printf("Cache invalidated: %s\n", (*link)->path);
+        cache_remove(link);
+      } else {
+        link = &(*link)->next;
+      }
+    }
+  }
+}
+
+/*
+ * Finds a cached file. With inotify, stale entries are dropped as soon as the
+ * file changes, so a hit makes no system call at all. Without it, we fall
+ * back to comparing the mtime and size with a stat().
+ *
+ * The encoding is part of the key: a sidecar fetched by its own name is a
+ * different response from the same file sent as a variant of the original.
+ * */
+
+struct cache_entry *cache_lookup(const char *path,
+                                 enum content_encoding encoding) {
+  struct cache_entry **link = &cache[hash_path(path) & (CACHE_BUCKETS - 1)];
+  for (; *link != NULL; link = &(*link)->next) {
+    struct cache_entry *entry = *link;
+    if (entry->encoding != encoding || strcmp(entry->path, path) != 0) {
+      continue;
+    }
+
+    if (inotify_fd < 0) {
+      struct stat path_stat;
+      if (stat(path, &path_stat) == -1 ||
+          path_stat.st_mtim.tv_sec != entry->mtime.tv_sec ||
+          path_stat.st_mtim.tv_nsec != entry->mtime.tv_nsec ||
+          path_stat.st_size != entry->size) {
+        cache_remove(link);
+        return NULL;
+      }
+    }
+
+    return entry;
+  }
+
+  return NULL;
+}
+
+/*
+ * Concatenates the header iovecs prepare_headers() produces into one buffer.
+ * */
+
+void serialize_headers(const struct mime_type *content_type,
+                       enum content_encoding encoding, off_t len,
+                       struct timespec mtime, bool keep_alive,
+                       struct iovec *out) {
+  struct iovec iov[HEADER_IOVEC_COUNT];
+  char buf[HEADER_BUF_SZ];
+  char validators[VALIDATORS_BUF_SZ];
+  prepare_headers("HTTP/1.1 200 OK\r\n", content_type, len,
+                  format_validators(mtime, len, validators),
+                  encoding_headers(content_type, encoding), accept_ranges_line,
+                  keep_alive, iov, buf);
+
+  out->iov_len = 0;
+  for (int i = 0; i < HEADER_IOVEC_COUNT; i++) {
+    out->iov_len += iov[i].iov_len;
+  }
+
+  out->iov_base = malloc(out->iov_len);
+  char *dest = out->iov_base;
+  for (int i = 0; i < HEADER_IOVEC_COUNT; i++) {
+    memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+    dest += iov[i].iov_len;
+  }
+}
+
+/*
+ * Wraps a file we have read into a cache entry with its headers serialized.
+ * The entry starts without references: either cache_insert() or a response
+ * takes the first one.
+ * */
+
+struct cache_entry *create_cache_entry(const char *path,
+                                       const struct mime_type *content_type,
+                                       enum content_encoding encoding,
+                                       char *body, off_t size,
+                                       struct timespec mtime, int wd) {
+  struct cache_entry *entry = malloc(sizeof(*entry));
+  entry->next = NULL;
+  entry->path = strdup(path);
+  entry->refcount = 0;
+  entry->wd = wd;
+  entry->mtime = mtime;
+  entry->size = size;
+  entry->body.iov_base = body;
+  entry->body.iov_len = size;
+  entry->buf_index = register_zerocopy_buffer(body, size);
+  entry->content_type = content_type;
+  entry->encoding = encoding;
+  entry->sidecars = 0;
+
+  serialize_headers(content_type, encoding, size, mtime, false,
+                    &entry->headers[false]);
+  serialize_headers(content_type, encoding, size, mtime, true,
+                    &entry->headers[true]);
+  return entry;
+}
+
+void cache_insert(struct cache_entry *entry) {
+  struct cache_entry **bucket =
+      &cache[hash_path(entry->path) & (CACHE_BUCKETS - 1)];
+  entry->next = *bucket;
+  *bucket = entry;
+  entry->refcount++; /* The cache's own reference */
+  cache_total_sz += entry->size;
+}
+
+/*
+ * Watches cached files so they can be dropped the moment they change. If
+ * inotify isn't available, cache_lookup() revalidates with stat() instead.
+ * */
+
+void setup_inotify() {
+  inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (inotify_fd < 0) {
+    perror("inotify_init1()");
+  }
+}
+
+/*
+ * Without working inotify, cache_lookup() falls back to checking every hit
+ * with stat().
+ * */
+void disable_inotify(int err) {
+  fprintf(stderr, "inotify failed, revalidating cached files with stat(): %s\n",
+          strerror(err));
+  queue_close_request(inotify_fd);
+  inotify_fd = -1;
+}
+
+void queue_inotify_request() {
+  struct io_uring_sqe *sqe = get_sqe();
+
+  io_uring_prep_read(sqe, inotify_fd, inotify_buf, sizeof(inotify_buf), 0);
+  io_uring_sqe_set_data64(sqe, inotify_req->id);
+}
+
+void handle_inotify_events(size_t len) {
+  for (size_t offset = 0; offset < len;) {
+    struct inotify_event *event = (struct inotify_event *)&inotify_buf[offset];
+    cache_invalidate_wd(event->wd);
+
+    /* Whatever is being read right now may already be out of date. */
+    for (struct file_request *file = loading_files; file != NULL;
+         file = file->next_loading) {
+      if (file->wd == event->wd) {
+        file->stale = true;
+      }
+    }
+
+    /* The watch is gone by itself after IN_IGNORED. */
+    if (!(event->mask & IN_IGNORED)) {
+      inotify_rm_watch(inotify_fd, event->wd);
+    }
+
+    offset += sizeof(*event) + event->len;
+  }
+}
+
+/*
+ * Serves a cached file: two shared buffers, no allocation besides the
+ * request itself and no file system access. A range of it gets headers of
+ * its own and a slice of the shared body. Returns the status code.
+ * */
+
+int fill_cached_file(struct request *req, struct cache_entry *entry,
+                     const struct byte_range *range, bool keep_alive) {
+  off_t first, len;
+  switch (resolve_range(range, entry->size, entry->mtime, &first, &len)) {
+  case RANGE_NOT_SATISFIABLE:
+    fill_range_not_satisfiable(req, entry->size, keep_alive);
+    return 416;
+
+  case RANGE_PARTIAL:
+    req->iovec_count = HEADER_IOVEC_COUNT + 1;
+    req->cache_entry = entry;
+    req->stream = NULL;
+    entry->refcount++;
+
+    prepare_headers(
+        "HTTP/1.1 206 Partial Content\r\n", entry->content_type, len,
+        format_validators(entry->mtime, entry->size, req->validators_buf),
+        encoding_headers(entry->content_type, entry->encoding),
+        format_content_range(req, first, len, entry->size), keep_alive,
+        req->iov, req->header_buf);
+    struct iovec *body = &req->iov[HEADER_IOVEC_COUNT];
+    body->iov_base = (char *)entry->body.iov_base + first;
+    body->iov_len = len;
+    return 206;
+
+  default:
+    req->iovec_count = 2;
+    req->cache_entry = entry;
+    req->stream = NULL;
+    entry->refcount++;
+
+    req->iov[0] = entry->headers[keep_alive];
+    req->iov[1] = entry->body;
+    return 200;
+  }
+}
+
+int send_cached_file(struct cache_entry *entry, const struct byte_range *range,
+                     struct conn *conn) {
+  struct request *req = alloc_request(EVENT_TYPE_WRITE);
+  req->conn = conn;
+  int status = fill_cached_file(req, entry, range, conn->keep_alive);
+  queue_write_request(req);
+  return status;
+}
+
+/*
+ * Cache misses are served without a single blocking file system call in the
+ * event loop: openat, statx and read are io_uring operations whose
+ * completions drive the response forward one step at a time. The response
+ * is queued on the connection right away so that pipelined responses behind
+ * it keep their order.
+ * */
+
+void queue_file_op(struct request *req, enum event_type event_type) {
+  struct file_request *file = req->file;
+  struct io_uring_sqe *sqe = get_sqe();
+
+  req->event_type = event_type;
+  switch (event_type) {
+  case EVENT_TYPE_PATH_STATX:
+    io_uring_prep_statx(sqe, AT_FDCWD, file->path, 0,
+                        STATX_TYPE | STATX_SIZE | STATX_MTIME, &file->stx);
+    break;
+
+  case EVENT_TYPE_OPENAT:
+    io_uring_prep_openat(sqe, AT_FDCWD, file->path, O_RDONLY | O_CLOEXEC, 0);
+    break;
+
+  case EVENT_TYPE_STATX:
+    io_uring_prep_statx(sqe, file->fd, "", AT_EMPTY_PATH,
+                        STATX_TYPE | STATX_SIZE | STATX_MTIME, &file->stx);
+    break;
+
+  case EVENT_TYPE_SIDECAR_STATX:
+    snprintf(file->sidecar_path, sizeof(file->sidecar_path), "%s%s",
+             file->path, encodings[sidecar_preference[file->sidecar]].suffix);
+    io_uring_prep_statx(sqe, AT_FDCWD, file->sidecar_path, 0, STATX_TYPE,
+                        &file->sidecar_stx);
+    break;
+
+  case EVENT_TYPE_FILE_READ:
+    io_uring_prep_read(sqe, file->fd, file->body + file->bytes_read,
+                       file->stx.stx_size - file->bytes_read,
+                       file->bytes_read);
+    break;
+
+  default:
+    fprintf(stderr, "Unexpected file event type = %d\n", event_type);
+    exit(EXIT_FAILURE);
+  }
+
+  io_uring_sqe_set_data64(sqe, req->id);
+}
+
+/*
+ * A conditional request starts with a statx() of the path: if the client's
+ * copy is current, the file is never opened. That only works when there is
+ * no choice of encoding to make, though, since each variant has validators
+ * of its own.
+ * */
+void queue_file_request(const char *path, const struct mime_type *content_type,
+                        unsigned accepted, const struct byte_range *range,
+                        const struct preconditions *preconditions,
+                        struct conn *conn) {
+  struct request *req = alloc_request(EVENT_TYPE_OPENAT);
+  req->conn = conn;
+
+  struct file_request *file = malloc(sizeof(*file));
+  strcpy(file->path, path);
+  file->keep_alive = conn->keep_alive;
+  file->range = *range;
+  file->preconditions = *preconditions;
+  file->content_type = content_type;
+  file->accepted = accepted;
+  file->encoding = ENCODING_IDENTITY;
+  file->sidecars = 0;
+  file->sidecar = content_type->compressible ? 0 : SIDECAR_COUNT;
+  file->fd = -1;
+  file->wd = -1;
+  file->stale = false;
+  file->body = NULL;
+  file->bytes_read = 0;
+  req->file = file;
+
+  req->event_type = EVENT_TYPE_OPENAT;
+  enqueue_write_request(req);
+  queue_file_op(req, is_conditional(preconditions) && accepted == 0
+                         ? EVENT_TYPE_PATH_STATX
+                         : EVENT_TYPE_OPENAT);
+}
+
+void release_file_request(struct request *req) {
+  struct file_request *file = req->file;
+
+  for (struct file_request **link = &loading_files; *link != NULL;
+       link = &(*link)->next_loading) {
+    if (*link == file) {
+      *link = file->next_loading;
+      break;
+    }
+  }
+
+  if (file->fd >= 0) {
+    queue_close_request(file->fd);
+  }
+
+  free(file->body);
+  free(file);
+  req->file = NULL;
+}
+
+struct timespec file_mtime(const struct file_request *file) {
+  struct timespec mtime = {.tv_sec = file->stx.stx_mtime.tv_sec,
+                           .tv_nsec = file->stx.stx_mtime.tv_nsec};
+  return mtime;
+}
+
+/*
+ * Turns the file we have read into the response, caching it unless it
+ * changed while we were reading.
+ * */
+
+void finish_file_read(struct request *req) {
+  struct file_request *file = req->file;
+
+  struct cache_entry *entry = create_cache_entry(
+      file->path, file->content_type, file->encoding, file->body,
+      file->bytes_read, file_mtime(file), file->wd);
+  entry->sidecars = file->sidecars;
+  entry->refcount++; /* Ours, until the response and the cache have theirs */
+  file->body = NULL; /* Owned by the entry now */
+
+  /* Someone else may have loaded the same file in the meantime. */
+  if (!file->stale && cache_lookup(file->path, file->encoding) == NULL) {
+    cache_insert(entry);
+  }
+
+  /*
+   * A 416 takes no reference, so an entry that didn't go into the cache
+   * has nobody left to free it but us.
+   * */
+  int status = fill_cached_file(req, entry, &file->range, file->keep_alive);
+  printf("%d %s %ld bytes\n", status, file->path, entry->size);
+  cache_entry_put(entry);
+}
+
+/*
+ * Answers with an error page instead of the file.
+ * */
+void fail_file_request(struct request *req, const char *status_line,
+                       const char *content) {
+  bool keep_alive = req->file->keep_alive;
+  release_file_request(req);
+  fill_static_string_content(req, status_line, content, NULL, keep_alive);
+  mark_write_request_ready(req);
+}
+
+/*
+ * Running out of descriptors or memory is our problem, not a missing file.
+ * */
+bool is_resource_error(int err) {
+  return err == EMFILE || err == ENFILE || err == ENOMEM;
+}
+
+/*
+ * Sends the file we have opened and stat'ed: splices it if it is too big to
+ * cache, otherwise reads it first.
+ * */
+void serve_opened_file(struct request *req) {
+  struct file_request *file = req->file;
+  off_t size = file->stx.stx_size;
+
+  /* Negotiated requests skip EVENT_TYPE_PATH_STATX, so check here. */
+  if (is_not_modified(&file->preconditions, file_mtime(file), size)) {
+    bool keep_alive = file->keep_alive;
+    printf("304 %s\n", file->path);
+    fill_not_modified(req, file->content_type, file->encoding,
+                      file_mtime(file), size, keep_alive);
+    release_file_request(req);
+    mark_write_request_ready(req);
+    return;
+  }
+
+  if (size > CACHE_MAX_FILE_SZ || cache_total_sz + size > CACHE_MAX_TOTAL_SZ) {
+    /*
+     * Too big to keep around: send the headers, then splice the body, or
+     * just the requested range of it.
+     * */
+    off_t first = 0, len = size;
+    enum range_result result =
+        resolve_range(&file->range, size, file_mtime(file), &first, &len);
+    if (result == RANGE_NOT_SATISFIABLE) {
+      bool keep_alive = file->keep_alive;
+      printf("416 %s\n", file->path);
+      release_file_request(req);
+      fill_range_not_satisfiable(req, size, keep_alive);
+      mark_write_request_ready(req);
+      return;
+    }
+
+    req->stream = create_file_stream(file->fd, first, len);
+    if (req->stream == NULL) {
+      /* Most likely out of descriptors for the pipe, or out of memory. */
+      count_error(errno);
+      fail_file_request(req, "HTTP/1.1 503 Service Unavailable\r\n",
+                        http_503_content);
+      return;
+    }
+
+    req->iovec_count = HEADER_IOVEC_COUNT;
+    const char *validators =
+        format_validators(file_mtime(file), size, req->validators_buf);
+    const char *encoding = encoding_headers(file->content_type, file->encoding);
+    if (result == RANGE_PARTIAL) {
+      prepare_headers("HTTP/1.1 206 Partial Content\r\n", file->content_type,
+                      len, validators, encoding,
+                      format_content_range(req, first, len, size),
+                      file->keep_alive, req->iov, req->header_buf);
+      printf("206 %s %ld-%ld/%ld bytes\n", file->path, first, first + len - 1,
+             size);
+    } else {
+      prepare_headers("HTTP/1.1 200 OK\r\n", file->content_type, size,
+                      validators, encoding, accept_ranges_line,
+                      file->keep_alive, req->iov, req->header_buf);
+      printf("200 %s %ld bytes\n", file->path, size);
+    }
+
+    file->fd = -1; /* Owned by the stream now */
+    release_file_request(req);
+    mark_write_request_ready(req);
+    return;
+  }
+
+  /*
+   * Watch the file before reading it, so a write racing with the read
+   * marks the result stale instead of leaving it in the cache.
+   * */
+  if (inotify_fd >= 0) {
+    file->wd = inotify_add_watch(inotify_fd, file->path,
+                                 IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                                     IN_DELETE_SELF | IN_MOVE_SELF);
+    file->stale = file->wd < 0;
+    file->next_loading = loading_files;
+    loading_files = file;
+  }
+
+  file->body = malloc(size);
+  if (size > 0) {
+    queue_file_op(req, EVENT_TYPE_FILE_READ);
+    return;
+  }
+
+  finish_file_read(req);
+  release_file_request(req);
+  mark_write_request_ready(req);
+}
+
+/*
+ * Tells every cached variant of the original at path which sidecars it has.
+ * They may have come or gone since the variants were loaded.
+ * */
+void update_cached_sidecars(char *path, unsigned sidecars) {
+  size_t len = strlen(path);
+  for (int encoding = 0; encoding < ENCODING_COUNT; encoding++) {
+    strcpy(path + len, encodings[encoding].suffix);
+    struct cache_entry *entry = cache_lookup(path, encoding);
+    if (entry != NULL) {
+      entry->sidecars = sidecars;
+    }
+  }
+  path[len] = '\0';
+}
+
+/*
+ * Switches from the original to the best sidecar the client accepts, now
+ * that we know which there are.
+ * */
+void select_sidecar(struct request *req) {
+  struct file_request *file = req->file;
+
+  update_cached_sidecars(file->path, file->sidecars);
+
+  for (size_t i = 0; i < SIDECAR_COUNT; i++) {
+    enum content_encoding encoding = sidecar_preference[i];
+    if (file->accepted & file->sidecars & ENCODING_BIT(encoding)) {
+      queue_close_request(file->fd);
+      file->fd = -1;
+      strcat(file->path, encodings[encoding].suffix);
+      file->encoding = encoding;
+      queue_file_op(req, EVENT_TYPE_OPENAT);
+      return;
+    }
+  }
+
+  serve_opened_file(req);
+}
+
+/*
+ * The sidecar went away between finding and opening it: send the original
+ * after all.
+ * */
+void fall_back_to_original(struct request *req) {
+  struct file_request *file = req->file;
+
+  if (file->fd >= 0) {
+    queue_close_request(file->fd);
+    file->fd = -1;
+  }
+  file->path[strlen(file->path) - strlen(encodings[file->encoding].suffix)] =
+      '\0';
+  file->sidecars &= ~ENCODING_BIT(file->encoding);
+  file->encoding = ENCODING_IDENTITY;
+  file->accepted = 0;
+  file->sidecar = SIDECAR_COUNT;
+  queue_file_op(req, EVENT_TYPE_OPENAT);
+}
+
+void handle_file_completion(struct request *req, int res) {
+  struct file_request *file = req->file;
+
+  if (req->conn == NULL) {
+    /* The connection went away while the file operation was in flight. */
+    release_file_request(req);
+    free_request(req);
+    return;
+  }
+
+  switch (req->event_type) {
+  case EVENT_TYPE_PATH_STATX:
+    if (res == 0 && S_ISREG(file->stx.stx_mode) &&
+        is_not_modified(&file->preconditions, file_mtime(file),
+                        file->stx.stx_size)) {
+      bool keep_alive = file->keep_alive;
+      printf("304 %s\n", file->path);
+      fill_not_modified(req, file->content_type, ENCODING_IDENTITY,
+                        file_mtime(file), file->stx.stx_size, keep_alive);
+      release_file_request(req);
+      mark_write_request_ready(req);
+      return;
+    }
+
+    /* Anything else, errors included, is up to the regular path. */
+    queue_file_op(req, EVENT_TYPE_OPENAT);
+    return;
+
+  case EVENT_TYPE_OPENAT:
+    if (res < 0 && is_resource_error(-res)) {
+      fail_file_request(req, "HTTP/1.1 503 Service Unavailable\r\n",
+                        http_503_content);
+      return;
+    }
+    if (res < 0 && file->encoding != ENCODING_IDENTITY) {
+      fall_back_to_original(req);
+      return;
+    }
+    if (res < 0) {
+      printf("Return 404: File Not Found: %s\n", file->path);
+      break;
+    }
+
+    file->fd = res;
+    queue_file_op(req, EVENT_TYPE_STATX);
+    return;
+
+  case EVENT_TYPE_STATX: {
+    /* If this is not a regular file, return 404. */
+    if (res < 0 || !S_ISREG(file->stx.stx_mode)) {
+      if (file->encoding != ENCODING_IDENTITY) {
+        fall_back_to_original(req);
+        return;
+      }
+      printf("Return 404: Not a Regular File: %s\n", file->path);
+      break;
+    }
+
+    /*
+     * Look for sidecars if the client takes one, or if the file is going
+     * into the cache, whose entry remembers them for later clients.
+     * */
+    off_t size = file->stx.stx_size;
+    bool cacheable = size <= CACHE_MAX_FILE_SZ &&
+                     cache_total_sz + size <= CACHE_MAX_TOTAL_SZ;
+    if (file->sidecar < SIDECAR_COUNT && (file->accepted != 0 || cacheable)) {
+      queue_file_op(req, EVENT_TYPE_SIDECAR_STATX);
+      return;
+    }
+
+    serve_opened_file(req);
+    return;
+  }
+
+  case EVENT_TYPE_SIDECAR_STATX:
+    if (res == 0 && S_ISREG(file->sidecar_stx.stx_mode)) {
+      file->sidecars |= ENCODING_BIT(sidecar_preference[file->sidecar]);
+    }
+    if (++file->sidecar < SIDECAR_COUNT) {
+      queue_file_op(req, EVENT_TYPE_SIDECAR_STATX);
+      return;
+    }
+
+    select_sidecar(req);
+    return;
+
+  case EVENT_TYPE_FILE_READ:
+    if (res < 0) {
+      printf("Return 404: Read Failed: %s\n", file->path);
+      break;
+    }
+
+    /* A read of 0 bytes means the file shrank: serve what there is. */
+    file->bytes_read += res;
+    if (res > 0 && file->bytes_read < (off_t)file->stx.stx_size) {
+      queue_file_op(req, EVENT_TYPE_FILE_READ);
+      return;
+    }
+
+    finish_file_read(req);
+    release_file_request(req);
+    mark_write_request_ready(req);
+    return;
+
+  default:
+    fprintf(stderr, "Unexpected file event type = %d\n", req->event_type);
+    exit(EXIT_FAILURE);
+  }
+
+  /* Any other failure above turns into a 404. */
+  fail_file_request(req, "HTTP/1.1 404 Not Found\r\n", http_404_content);
+}
+
+/*
+ * Answers from the cache: a 304 if the client's copy is still good, the
+ * (partial) body otherwise.
+ * */
+void serve_cached_entry(struct cache_entry *entry,
+                        const struct byte_range *range,
+                        const struct preconditions *preconditions,
+                        struct conn *conn) {
+  if (is_not_modified(preconditions, entry->mtime, entry->size)) {
+    struct request *req = alloc_request(EVENT_TYPE_WRITE);
+    req->conn = conn;
+    fill_not_modified(req, entry->content_type, entry->encoding, entry->mtime,
+                      entry->size, conn->keep_alive);
+    queue_write_request(req);
+    printf("304 %s (cached)\n", entry->path);
+    return;
+  }
+
+  int status = send_cached_file(entry, range, conn);
+  printf("%d %s %ld bytes (cached)\n", status, entry->path, entry->size);
+}
+
+void handle_get_verb(const char *path, size_t path_len,
+                     const struct byte_range *range,
+                     const struct preconditions *preconditions,
+                     unsigned accepted, struct conn *conn) {
+  char final_path[1024] = "http-home";
+  size_t prefix_len = strlen(final_path);
+  /* Leave room for the index file and a sidecar suffix after it. */
+  if (prefix_len + path_len + strlen("index.html.br") >= sizeof(final_path)) {
+    handle_http_404(conn);
+    return;
+  }
+  memcpy(final_path + prefix_len, path, path_len);
+  final_path[prefix_len + path_len] = '\0';
+
+  /*
+   If a path ends in a trailing slash, the client probably wants the index
+   file inside of that directory.
+   */
+  if (path[path_len - 1] == '/') {
+    strcat(final_path, "index.html");
+  }
+
+  const struct mime_type *content_type = get_content_type(final_path);
+  if (!content_type->compressible) {
+    accepted = 0;
+  }
+
+  /*
+   * Any cached variant knows which sidecars the original has. With that, a
+   * request for a variant we have cached never needs the file system.
+   * */
+  size_t len = strlen(final_path);
+  struct cache_entry *original = cache_lookup(final_path, ENCODING_IDENTITY);
+  struct cache_entry *known = original;
+  for (size_t i = 0; known == NULL && accepted != 0 && i < SIDECAR_COUNT; i++) {
+    enum content_encoding encoding = sidecar_preference[i];
+    strcpy(final_path + len, encodings[encoding].suffix);
+    known = cache_lookup(final_path, encoding);
+  }
+  final_path[len] = '\0';
+
+  if (known != NULL) {
+    struct cache_entry *entry = original;
+    for (size_t i = 0; i < SIDECAR_COUNT; i++) {
+      enum content_encoding encoding = sidecar_preference[i];
+      if (known->sidecars & accepted & ENCODING_BIT(encoding)) {
+        strcpy(final_path + len, encodings[encoding].suffix);
+        entry = cache_lookup(final_path, encoding);
+        final_path[len] = '\0';
+        break;
+      }
+    }
+
+    if (entry != NULL) {
+      serve_cached_entry(entry, range, preconditions, conn);
+      return;
+    }
+  }
+
+  queue_file_request(final_path, content_type, accepted, range, preconditions,
+                     conn);
+}
+
+/*
+ * Decides whether the connection outlives this request. HTTP/1.1 keeps it
+ * open unless the client sends "Connection: close"; HTTP/1.0 closes it unless
+ * the client sends "Connection: keep-alive".
+ * */
+
+bool wants_keep_alive(const struct http_parser *parser, const char *buf) {
+  bool keep_alive = slice_equals(buf, parser->version, "HTTP/1.1");
+
+  const struct http_header *connection = find_header(parser, buf, "connection");
+  if (connection != NULL) {
+    if (slice_has_token(buf, connection->value, "close")) {
+      keep_alive = false;
+    } else if (slice_has_token(buf, connection->value, "keep-alive")) {
+      keep_alive = true;
+    }
+  }
+
+  return keep_alive;
+}
+
+/*
+ * Parses a byte position of a Range header, advancing *p past its digits.
+ * */
+bool parse_range_offset(const char **p, const char *end, off_t *value) {
+  const char *start = *p;
+  off_t result = 0;
+  for (; *p < end && isdigit((unsigned char)**p); (*p)++) {
+    if (result > (INT64_MAX - 9) / 10) {
+      return false;
+    }
+    result = result * 10 + (**p - '0');
+  }
+
+  *value = result;
+  return *p > start;
+}
+
+/*
+ * Reads the Range and If-Range headers of a request. A Range header we
+ * can't parse, or that asks for several ranges, is ignored.
+ * */
+void parse_range(const struct http_parser *parser, const char *buf,
+                 struct byte_range *range) {
+  range->requested = false;
+  range->if_range[0] = '\0';
+
+  const struct http_header *header = find_header(parser, buf, "range");
+  if (header == NULL) {
+    return;
+  }
+
+  const char *p = slice_ptr(buf, header->value);
+  const char *end = p + header->value.len;
+  if (end - p < 6 || strncasecmp(p, "bytes=", 6) != 0) {
+    return;
+  }
+  p += 6;
+
+  off_t first = -1;
+  off_t last = -1;
+  if (p < end && *p != '-' && !parse_range_offset(&p, end, &first)) {
+    return;
+  }
+  if (p == end || *p++ != '-') {
+    return;
+  }
+  if (p < end && !parse_range_offset(&p, end, &last)) {
+    return;
+  }
+  if (p != end || (first < 0 && last < 0) || (last >= 0 && last < first)) {
+    return;
+  }
+
+  header = find_header(parser, buf, "if-range");
+  if (header != NULL) {
+    if (header->value.len >= IF_RANGE_SZ) {
+      return; /* Can't be one of ours, so the file has to go out whole. */
+    }
+    memcpy(range->if_range, slice_ptr(buf, header->value), header->value.len);
+    range->if_range[header->value.len] = '\0';
+  }
+
+  range->first = first;
+  range->last = last;
+  range->requested = true;
+}
+
+/*
+ * Reads If-None-Match and If-Modified-Since. A list of ETags too long to
+ * keep or a date we can't parse is ignored, which just means a full
+ * response.
+ * */
+void parse_preconditions(const struct http_parser *parser, const char *buf,
+                         struct preconditions *preconditions) {
+  preconditions->if_none_match[0] = '\0';
+  preconditions->if_modified_since = -1;
+
+  const struct http_header *header =
+      find_header(parser, buf, "if-none-match");
+  if (header != NULL && header->value.len > 0 &&
+      header->value.len < IF_NONE_MATCH_SZ) {
+    memcpy(preconditions->if_none_match, slice_ptr(buf, header->value),
+           header->value.len);
+    preconditions->if_none_match[header->value.len] = '\0';
+  }
+
+  header = find_header(parser, buf, "if-modified-since");
+  if (header != NULL && header->value.len < HTTP_DATE_SZ) {
+    char date[HTTP_DATE_SZ];
+    memcpy(date, slice_ptr(buf, header->value), header->value.len);
+    date[header->value.len] = '\0';
+    preconditions->if_modified_since = parse_http_date(date);
+  }
+}
+
+/*
+ * Returns the sidecar encodings the client accepts, as ENCODING_BIT()s. An
+ * Accept-Encoding of "gzip, br;q=0.5" accepts both; "br;q=0" or
+ * "*;q=0" rule a coding out. We have no use for the weights otherwise: our
+ * own preference, sidecar_preference, decides between the ones left.
+ * */
+unsigned parse_accept_encoding(const struct http_parser *parser,
+                               const char *buf) {
+  const struct http_header *header =
+      find_header(parser, buf, "accept-encoding");
+  if (header == NULL) {
+    return 0;
+  }
+
+  unsigned accepted = 0, listed = 0;
+  bool wildcard = false;
+  const char *p = slice_ptr(buf, header->value);
+  const char *end = p + header->value.len;
+  while (p < end) {
+    while (p < end && (*p == ',' || *p == ' ' || *p == '\t')) {
+      p++;
+    }
+
+    const char *name = p;
+    while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') {
+      p++;
+    }
+    size_t name_len = p - name;
+
+    /* Only "q=0", "q=0.", "q=0.0" and so on refuse the coding. */
+    bool refused = false;
+    const char *param_end = memchr(p, ',', end - p);
+    if (param_end == NULL) {
+      param_end = end;
+    }
+    const char *q = p;
+    while (q < param_end && *q != ';') {
+      q++;
+    }
+    if (q < param_end) {
+      q++;
+      while (q < param_end && (*q == ' ' || *q == '\t')) {
+        q++;
+      }
+      if (param_end - q >= 3 && (q[0] == 'q' || q[0] == 'Q') && q[1] == '=' &&
+          q[2] == '0') {
+        refused = true;
+        for (q += 3; q < param_end && *q != ' ' && *q != '\t'; q++) {
+          if (*q != '.' && *q != '0') {
+            refused = false;
+          }
+        }
+      }
+    }
+    p = param_end;
+
+    unsigned bit = 0;
+    if ((name_len == 4 && strncasecmp(name, "gzip", 4) == 0) ||
+        (name_len == 6 && strncasecmp(name, "x-gzip", 6) == 0)) {
+      bit = ENCODING_BIT(ENCODING_GZIP);
+    } else if (name_len == 2 && strncasecmp(name, "br", 2) == 0) {
+      bit = ENCODING_BIT(ENCODING_BR);
+    } else if (name_len == 1 && *name == '*') {
+      wildcard = !refused;
+      continue;
+    }
+
+    listed |= bit;
+    if (!refused) {
+      accepted |= bit;
+    }
+  }
+
+  /* "*" stands for every coding not listed by name. */
+  if (wildcard) {
+    accepted |= (ENCODING_BIT(ENCODING_GZIP) | ENCODING_BIT(ENCODING_BR)) &
+                ~listed;
+  }
+
+  return accepted;
 }
 
-void handle_get_verb(char *path, int client_socket) {
-  char final_path[1024] = "http-home";
-  strcat(final_path, path);
+/*
+ * Answers a request the parser has completely parsed. buf is the start of
+ * the request, which every slice in parser is relative to.
+ * */
 
-  /*
-   If a path ends in a trailing slash, the client probably wants the index
-   file inside of that directory.
-   */
-  if (path[strlen(path) - 1] == '/') {
-    strcat(final_path, "index.html");
+void handle_read_request(struct conn *conn, const struct http_parser *parser,
+                         const char *buf) {
+  conn->keep_alive = wants_keep_alive(parser, buf);
+
+  // We only support the GET verb.
+  if (slice_equals(buf, parser->method, "GET")) {
+    struct byte_range range;
+    struct preconditions preconditions;
+    parse_range(parser, buf, &range);
+    parse_preconditions(parser, buf, &preconditions);
+    handle_get_verb(slice_ptr(buf, parser->path), parser->path.len, &range,
+                    &preconditions, parse_accept_encoding(parser, buf), conn);
+  } else {
+    handle_unimplemented_method(conn);
   }
+}
 
-  /* The stat() system call will give you information about the file
-   * like type (regular file, directory, etc), size, etc. */
-  struct stat path_stat;
-  if (stat(final_path, &path_stat) == -1) {
-    printf("Return 404: File Not Found: %s\n", final_path);
-    handle_http_404(client_socket);
-    return;
+/*
+ * Handles every complete request in buf, queueing one response for each.
+ * A request is complete once its blank line has arrived (we only serve GET,
+ * so there is no body to wait for). Returns the number of bytes consumed;
+ * whatever is left is the start of a request that is still on the wire, and
+ * conn->parser remembers how much of it has been parsed already. A malformed
+ * request gets a 400 and ends the connection, so all of buf is consumed.
+ * */
+
+size_t handle_requests(struct conn *conn, const char *buf, size_t len) {
+  size_t consumed = 0;
+  while (conn->keep_alive && consumed < len) {
+    const char *start = buf + consumed;
+    long request_len = http_parse(&conn->parser, start, len - consumed);
+    if (request_len == 0) {
+      break;
+    }
+
+    if (request_len < 0) {
+      count_malformed_request();
+      conn->keep_alive = false;
+      handle_unimplemented_method(conn);
+      return len;
+    }
+
+    handle_read_request(conn, &conn->parser, start);
+    http_parser_reset(&conn->parser);
+    consumed += request_len;
   }
 
-  /* If this is not a regular file, return 404. */
-  if (!S_ISREG(path_stat.st_mode)) {
-    printf("Return 404: Not a Regular File: %s\n", final_path);
-    handle_http_404(client_socket);
-    return;
+  return consumed;
+}
+
+/*
+ * Feeds freshly received bytes to the request parser. The read buffer goes
+ * back to the kernel as soon as we return, so a trailing partial request is
+ * copied into conn->partial and completed by the following reads. A request
+ * whose headers don't fit in READ_SZ is rejected.
+ * */
+
+void handle_read_buffer(struct conn *conn, const char *buf, size_t len) {
+  size_t offset = 0;
+
+  if (conn->partial != NULL) {
+    size_t old_len = conn->partial_len;
+    size_t copy_len = min(len, READ_SZ - old_len);
+    memcpy(conn->partial + old_len, buf, copy_len);
+    conn->partial_len += copy_len;
+
+    size_t consumed = handle_requests(conn, conn->partial, conn->partial_len);
+    if (consumed == 0) {
+      if (conn->partial_len == READ_SZ) {
+        fprintf(stderr, "Request headers too large\n");
+        conn->keep_alive = false;
+        handle_unimplemented_method(conn);
+      }
+      return;
+    }
+
+    /* The old bytes held no complete request, so it ended in the new ones. */
+    offset = consumed - old_len;
+    free(conn->partial);
+    conn->partial = NULL;
+    conn->partial_len = 0;
   }
 
-  struct request *req = malloc(sizeof(*req) + (sizeof(req->iov[0]) * 6));
-  req->iovec_count = 6;
-  req->client_socket = client_socket;
+  offset += handle_requests(conn, buf + offset, len - offset);
 
-  prepare_headers(final_path, path_stat.st_size, req->iov);
-  copy_file_contents(final_path, path_stat.st_size, &req->iov[5]);
-  queue_write_request(req);
+  if (conn->keep_alive && offset < len) {
+    conn->partial = malloc(READ_SZ);
+    conn_set_timeout(conn, REQUEST_TIMEOUT_SEC);
+    conn->partial_len = len - offset;
+    memcpy(conn->partial, buf + offset, conn->partial_len);
+  }
+}
+
+/*
+ * Frees a response that isn't in flight, whether or not it was all written.
+ * */
+
+void free_write_request(struct request *req) {
+  if (req->cache_entry != NULL) {
+    cache_entry_put(req->cache_entry);
+  }
+
+  if (req->stream != NULL) {
+    free_file_stream(req->stream);
+  }
 
-  printf("200 %s %ld bytes\n", final_path, path_stat.st_size);
+  free_request(req);
 }
 
-int get_line(const char *src, char *dest, int dest_sz) {
-  for (int i = 0; i + 1 < dest_sz; i++) {
-    if (src[i] == '\r' && src[i + 1] == '\n') {
-      dest[i] = '\0';
-      return 0;
+/*
+ * Drops every queued response of a connection we are about to close.
+ * */
+
+void discard_write_requests(struct conn *conn) {
+  while (conn->write_head != NULL) {
+    struct request *req = conn->write_head;
+    conn->write_head = req->next;
+
+    if (req->file != NULL) {
+      /* A file operation is in flight; it frees the response when done. */
+      req->conn = NULL;
+    } else {
+      free_write_request(req);
     }
+  }
+  conn->write_tail = NULL;
+}
+
+/*
+ * Gives up on a connection, dropping whatever it still had to send. None of
+ * its socket operations may be in flight.
+ * */
+
+void abort_conn(struct conn *conn) {
+  discard_write_requests(conn);
+  close_conn(conn);
+}
+
+/*
+ * Called once a response has been written out completely. Frees it and
+ * either starts the next pipelined response, waits for the next request or
+ * closes the connection.
+ * */
+
+void complete_write_request(struct request *req) {
+  struct conn *conn = req->conn;
+
+  conn->write_head = req->next;
+  free_write_request(req);
 
-    dest[i] = src[i];
+  if (conn->write_head != NULL) {
+    /* If its file isn't read yet, it is sent once it is. */
+    if (conn->write_head->event_type == EVENT_TYPE_WRITE) {
+      submit_write_request(conn->write_head);
+    }
+    return;
   }
 
-  return -1;
+  conn->write_tail = NULL;
+  if (conn->keep_alive) {
+    queue_read_request(conn);
+  } else {
+    close_conn(conn);
+  }
 }
 
-void get_verb_and_path(char *line, char **verb, char **path) {
-  char *save_ptr;
-  *verb = strtok_r(line, " ", &save_ptr);
-  *path = strtok_r(NULL, " ", &save_ptr);
-}
-
-int handle_read_request(struct request *req) {
-  // An example of the content of "req->iov[0].iov_base" is like the following:
-  //
-  // GET /index.html HTTP/1.1\r\n
-  // Host: 127.0.0.1:8000\r\n
-  // User-Agent: curl/8.5.0\r\n
-  // Accept: */*\r\n\r\n
-
-  /* Get the first line, which will be the request */
-  char first_line[1024];
-  size_t first_line_size = min(req->iov[0].iov_len, sizeof(first_line));
-  int ret = get_line(req->iov[0].iov_base, first_line, first_line_size);
-  if (ret < 0) {
-    fprintf(stderr, "Malformed request\n");
-    exit(1);
+/*
+ * Accounts for one of the splices queued by queue_stream_chunk(). Once all of
+ * them are back we either send the next chunk or finish the response.
+ * */
+
+void handle_splice_completion(struct request *req, int res) {
+  struct conn *conn = req->conn;
+  struct request *head = conn->write_head;
+  struct file_stream *stream = head->stream;
+
+  if (res < 0 && res != -ECANCELED) {
+    stream->failed = true; /* Usually EPIPE, the client is gone */
   }
-  // Now first_line == "GET /index.html HTTP/1.1"
 
-  char *verb;
-  char *path;
-  get_verb_and_path(first_line, &verb, &path);
+  if (req->event_type == EVENT_TYPE_SPLICE_IN) {
+    if (res == 0) {
+      stream->truncated = true;
+    }
+    if (res > 0) {
+      stream->offset += res;
+      stream->remaining -= res;
+      stream->in_pipe += res;
+    }
+  } else if (res > 0) {
+    /*
+     * -ECANCELED: either the file -> pipe half was short, which breaks the
+     * link, or the connection timed out.
+     * */
+    stream->in_pipe -= res;
+    conn_set_timeout(conn, WRITE_TIMEOUT_SEC);
+  }
 
-  str_tolower(verb);
-  // We only support the GET verb.
-  if (strcmp(verb, "get") == 0) {
-    handle_get_verb(path, req->client_socket);
-  } else {
-    handle_unimplemented_method(req->client_socket);
+  if (--stream->inflight > 0) {
+    return;
   }
 
-  return 0;
+  if (conn->timed_out) {
+    abort_conn(conn);
+    return;
+  }
+
+  if (stream->truncated) {
+    /* We promised more bytes than the file now has, give up on the client. */
+    fprintf(stderr, "File truncated while being sent\n");
+    abort_conn(conn);
+    return;
+  }
+
+  if (stream->failed) {
+    abort_conn(conn);
+    return;
+  }
+
+  if (stream->remaining > 0 || stream->in_pipe > 0) {
+    queue_stream_chunk(conn);
+    return;
+  }
+
+  complete_write_request(head);
 }
 
-void server_loop() {
-  queue_accept_request();
+/*
+ * Accounts for a zero-copy send of the body of the response at the head of
+ * the connection's write queue. Its notification is handled in handle_cqe().
+ * */
 
-  while (true) {
-    struct io_uring_cqe *cqe;
-    int ret = io_uring_wait_cqe(&ring, &cqe);
-    if (ret < 0) {
-      fprintf(stderr, "io_uring_wait_cqe() failed. error = %s\n",
-              strerror(-ret));
-      exit(1);
+void handle_zerocopy_completion(struct conn *conn, int res) {
+  struct request *head = conn->write_head;
+
+  if (conn->timed_out || res < 0) {
+    abort_conn(conn);
+    return;
+  }
+
+  conn_set_timeout(conn, WRITE_TIMEOUT_SEC);
+  if (!advance_write_request(head, res)) {
+    submit_write_request(head);
+    return;
+  }
+
+  complete_write_request(head);
+}
+
+/*
+ * Failures that are just how things normally go: a timer expiring, a
+ * sidecar that isn't there (most files have none), a cancellation that
+ * found nothing left to cancel.
+ * */
+bool is_expected_failure(enum event_type event_type, int res) {
+  switch (event_type) {
+  case EVENT_TYPE_TIMER:
+    return res == -ETIME;
+  case EVENT_TYPE_SIDECAR_STATX:
+  case EVENT_TYPE_CANCEL:
+    return res == -ENOENT;
+  default:
+    return false;
+  }
+}
+
+/*
+ * Handles one completion. Any SQEs it queues are submitted by server_loop()
+ * together with those of the rest of the batch.
+ *
+ * No failure here is fatal. A failed socket operation closes its connection,
+ * a failed file operation turns into an error response, and everything
+ * else is retried or logged. All of them are counted, see count_error().
+ * */
+
+void handle_cqe(struct io_uring_cqe *cqe) {
+  struct request *req = get_request(cqe->user_data);
+  if (cqe->res < 0 && !is_expected_failure(req->event_type, cqe->res)) {
+    count_error(-cqe->res);
+  }
+
+  if (req->event_type == EVENT_TYPE_READ && req->conn->timed_out) {
+    /* Cancelled, or it raced with the cancellation. Either way we're done. */
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      recycle_buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    close_conn(req->conn);
+    free_request(req);
+    return;
+  }
+
+  if (req->event_type == EVENT_TYPE_WRITE && req->conn->timed_out) {
+    /* The response is freed along with the rest of the queue. */
+    abort_conn(req->conn);
+    return;
+  }
+
+  if (req->event_type == EVENT_TYPE_READ && cqe->res == -ENOBUFS) {
+    /*
+     * Every provided buffer is waiting in the CQ to be parsed. They are
+     * recycled as we process those CQEs, so just try the read again.
+     * */
+    queue_read_request(req->conn);
+    free_request(req);
+    return;
+  }
+
+  switch (req->event_type) {
+  case EVENT_TYPE_ACCEPT:
+    if (cqe->res == -ENFILE) {
+      /* Re-armed by close_conn(); retrying now would just fail again. */
+      fprintf(stderr, "Out of connection slots, pausing accept\n");
+      if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        accept_paused = true;
+      }
+      break;
     }
 
-    struct request *req = (struct request *)cqe->user_data;
+    /* E.g. ECONNABORTED: that client is gone, keep accepting the others. */
     if (cqe->res < 0) {
-      fprintf(stderr, "Async request failed: %s for event: %d\n",
-              strerror(-cqe->res), req->event_type);
-      exit(1);
+      if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        queue_accept_request();
+      }
+      break;
+    }
+
+    struct conn *conn = create_conn(cqe->res);
+    if (conn != NULL) {
+      queue_read_request(conn);
+    } else {
+      /* Out of memory: turn this client away rather than crash. */
+      count_error(ENOMEM);
+      queue_close_direct_request(cqe->res);
     }
 
-    switch (req->event_type) {
-    case EVENT_TYPE_ACCEPT:
+    /*
+     * The kernel clears IORING_CQE_F_MORE when it stops the multishot
+     * accept (e.g. on an error), in which case we have to arm it again.
+     * */
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
       queue_accept_request();
-      queue_read_request(cqe->res);
-      break;
+    }
+    break;
 
-    case EVENT_TYPE_READ:
-      if (cqe->res == 0) {
-        fprintf(stderr, "Empty request!\n");
-        break;
-      }
+  case EVENT_TYPE_READ:
+    /* The client hung up: how keep-alive connections normally end. */
+    if (cqe->res == 0) {
+      close_conn(req->conn);
+      break;
+    }
 
-      handle_read_request(req);
-      free(req->iov[0].iov_base);
+    /* E.g. ECONNRESET. Nothing is queued on the connection while reading. */
+    if (cqe->res < 0) {
+      close_conn(req->conn);
       break;
+    }
+
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    handle_read_buffer(req->conn, get_buffer(bid), cqe->res);
+    recycle_buffer(bid);
 
-    case EVENT_TYPE_WRITE:
-      for (int i = 0; i < req->iovec_count; i++) {
-        free(req->iov[i].iov_base);
+    /* Nothing to answer yet: the rest of the request is still coming. */
+    if (req->conn->write_head == NULL) {
+      if (req->conn->keep_alive) {
+        queue_read_request(req->conn);
+      } else {
+        close_conn(req->conn);
       }
-      close(req->client_socket);
+    }
+    break;
+
+  case EVENT_TYPE_WRITE:
+    if (cqe->res < 0) {
+      /* E.g. EPIPE. The response is freed along with the rest of the queue. */
+      abort_conn(req->conn);
+      return;
+    }
+
+    conn_set_timeout(req->conn, WRITE_TIMEOUT_SEC);
+    if (!advance_write_request(req, cqe->res)) {
+      /* Short write: send the rest before anything else on this socket. */
+      submit_write_request(req);
+      return;
+    }
+
+    if (req->stream != NULL) {
+      /* Headers are out, the body follows straight from the file. */
+      queue_stream_chunk(req->conn);
+    } else {
+      complete_write_request(req);
+    }
+
+    /* The response is freed by complete_write_request(), not below. */
+    return;
+
+  case EVENT_TYPE_SPLICE_IN:
+  case EVENT_TYPE_SPLICE_OUT:
+    handle_splice_completion(req, cqe->res);
+    break;
+
+  case EVENT_TYPE_INOTIFY:
+    if (cqe->res < 0) {
+      disable_inotify(-cqe->res);
       break;
+    }
 
-    default:
-      fprintf(stderr, "Unexpected event type = %d\n", req->event_type);
+    handle_inotify_events(cqe->res);
+    queue_inotify_request();
+    break;
+
+  case EVENT_TYPE_PATH_STATX:
+  case EVENT_TYPE_OPENAT:
+  case EVENT_TYPE_STATX:
+  case EVENT_TYPE_SIDECAR_STATX:
+  case EVENT_TYPE_FILE_READ:
+    /* The response is still queued on its connection, don't free it. */
+    handle_file_completion(req, cqe->res);
+    return;
+
+  case EVENT_TYPE_CLOSE:
+    if (cqe->res < 0) {
+      fprintf(stderr, "close() failed. error = %s\n", strerror(-cqe->res));
+    }
+    break;
+
+  case EVENT_TYPE_TIMER:
+    handle_timer_tick();
+    break;
+
+  case EVENT_TYPE_CANCEL:
+    /* Nothing left to cancel (-ENOENT) is fine, expire_conn() retries. */
+    break;
+
+  case EVENT_TYPE_SEND_ZC:
+    /*
+     * The kernel is done with the body. The connection may be long gone by
+     * now, so only the cache entry is touched.
+     * */
+    if (cqe->flags & IORING_CQE_F_NOTIF) {
+      cache_entry_put(req->cache_entry);
       break;
     }
 
-    free(req);
-    /* Mark this request as processed */
-    io_uring_cqe_seen(&ring, cqe);
+    handle_zerocopy_completion(req->conn, cqe->res);
+
+    /* IORING_CQE_F_MORE: the notification follows with the same user_data. */
+    if (cqe->flags & IORING_CQE_F_MORE) {
+      return;
+    }
+    cache_entry_put(req->cache_entry);
+    break;
+
+  default:
+    fprintf(stderr, "Unexpected event type = %d\n", req->event_type);
+    break;
+  }
+
+  if (req != accept_req && req != inotify_req && req != close_req &&
+      req != timer_req && req != cancel_req) {
+    free_request(req);
+  }
+}
+
+/*
+ * Each iteration submits everything queued while handling the previous batch
+ * and waits for at least one completion in a single io_uring_enter(), then
+ * handles every completion that is ready before entering the kernel again.
+ * Under load that is one system call for many requests. With SQPOLL there is
+ * nothing to submit, and no system call at all while completions keep coming.
+ * */
+
+void server_loop() {
+  queue_accept_request();
+  queue_timer_request();
+  if (inotify_fd >= 0) {
+    queue_inotify_request();
+  }
+
+  while (true) {
+    struct io_uring_cqe *cqe;
+    int ret = 0;
+    if (sqpoll_idle_ms < 0) {
+      ret = io_uring_submit_and_wait(&ring, 1);
+    } else {
+      submit_sqes();
+      if (io_uring_cq_ready(&ring) == 0) {
+        cq_waits++;
+        ret = io_uring_wait_cqe(&ring, &cqe);
+      }
+    }
+    if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+      fprintf(stderr, "Waiting for completions failed. error = %s\n",
+              strerror(-ret));
+      exit(1);
+    }
+
+    unsigned head;
+    unsigned count = 0;
+    io_uring_for_each_cqe(&ring, head, cqe) {
+      handle_cqe(cqe);
+      count++;
+    }
+
+    /* Mark the whole batch as processed */
+    io_uring_cq_advance(&ring, count);
   }
 }
 
 void sigint_handler(int signo) {
   printf("Ctrl-C pressed. Shutting down.\n");
-  io_uring_queue_exit(&ring);
+  /* Exiting tears down every worker's ring. */
   exit(0);
 }
 
-int main() {
-  signal(SIGINT, sigint_handler);
+struct worker {
+  pthread_t thread;
+  int id;
+  int cpu; /* CPU to pin the worker to, or -1 */
+};
+
+void *worker_main(void *arg) {
+  struct worker *worker = arg;
+  worker_id = worker->id;
+
+  if (worker->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (ret != 0) {
+      fprintf(stderr, "pthread_setaffinity_np() failed. error = %s\n",
+              strerror(ret));
+    }
+  }
+
+  struct io_uring_params params = {};
+  if (sqpoll_idle_ms >= 0) {
+    params.flags = IORING_SETUP_SQPOLL | IORING_SETUP_ATTACH_WQ;
+    params.sq_thread_idle = sqpoll_idle_ms;
+    params.wq_fd = sqpoll_ring.ring_fd;
+  }
+
+  int ret = io_uring_queue_init_params(QUEUE_DEPTH, &ring, &params);
+  if (ret < 0) {
+    fprintf(stderr, "io_uring_queue_init_params() failed. error = %s\n",
+            strerror(-ret));
+    exit(1);
+  }
+
+  setup_persistent_requests();
 
-  io_uring_queue_init(QUEUE_DEPTH, &ring, 0);
+  setup_file_table();
+
+  setup_buffer_ring();
+
+  setup_zerocopy();
+
+  setup_inotify();
 
   setup_listening_socket();
 
   server_loop();
 
+  return NULL;
+}
+
+/*
+ * Creates the ring whose SQ thread every worker ring attaches to. It never
+ * gets an SQE itself. File operations use regular file descriptors, which
+ * SQPOLL only allows since Linux 5.11 (IORING_FEAT_SQPOLL_NONFIXED); client
+ * sockets are registered files either way.
+ * */
+void setup_sqpoll() {
+  struct io_uring_params params = {};
+  params.flags = IORING_SETUP_SQPOLL;
+  params.sq_thread_idle = sqpoll_idle_ms;
+  if (sqpoll_cpu >= 0) {
+    params.flags |= IORING_SETUP_SQ_AFF;
+    params.sq_thread_cpu = sqpoll_cpu;
+  }
+
+  int ret = io_uring_queue_init_params(1, &sqpoll_ring, &params);
+  if (ret < 0) {
+    fprintf(stderr, "Setting up the SQPOLL ring failed. error = %s\n",
+            strerror(-ret));
+    exit(1);
+  }
+
+  if (!(params.features & IORING_FEAT_SQPOLL_NONFIXED)) {
+    fprintf(stderr, "SQPOLL needs Linux 5.11 or later.\n");
+    exit(1);
+  }
+}
+
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-w workers] [-a] [-m mime.types] [-z] [-s idle_ms] "
+          "[-c cpu]\n"
+          "  -w  number of worker threads, 0 for one per CPU (default 1)\n"
+          "  -a  pin worker i to CPU i\n"
+          "  -m  load more content types from a mime.types style file\n"
+          "  -z  send large cached files with zero-copy send\n"
+          "  -s  submit through a kernel SQ thread shared by all workers,\n"
+          "      which sleeps after idle_ms without work\n"
+          "  -c  pin the SQ thread to a CPU (with -s)\n",
+          prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  long nr_workers = 1;
+  bool pin_workers = false;
+
+  int opt;
+  const char *mime_types_file = NULL;
+  while ((opt = getopt(argc, argv, "w:am:zs:c:")) != -1) {
+    switch (opt) {
+    case 'w':
+      nr_workers = strtol(optarg, NULL, 10);
+      break;
+    case 'a':
+      pin_workers = true;
+      break;
+    case 'm':
+      mime_types_file = optarg;
+      break;
+    case 'z':
+      zerocopy_enabled = true;
+      break;
+    case 's':
+      sqpoll_idle_ms = (int)strtol(optarg, NULL, 10);
+      break;
+    case 'c':
+      sqpoll_cpu = (int)strtol(optarg, NULL, 10);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nr_workers == 0) {
+    nr_workers = nr_cpus;
+  }
+  if (nr_workers < 0 || (sqpoll_cpu >= 0 && sqpoll_idle_ms < 0)) {
+    usage(argv[0]);
+  }
+
+  signal(SIGINT, sigint_handler);
+  /*
+   * Responses go out with writev, which unlike send can't take MSG_NOSIGNAL.
+   * A client that goes away with responses still queued must only cost its
+   * own connection: the write fails with EPIPE and we close it.
+   * */
+  signal(SIGPIPE, SIG_IGN);
+
+  const char *parser_impl = select_find_delim();
+  setup_mime_types(mime_types_file);
+  if (sqpoll_idle_ms >= 0) {
+    setup_sqpoll();
+  }
+
+  /* Each worker's registered file table is bounded by RLIMIT_NOFILE. */
+  struct rlimit rlim;
+  if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+    rlim.rlim_cur = rlim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rlim);
+  }
+
+  struct worker *workers = calloc(nr_workers, sizeof(*workers));
+  for (long i = 0; i < nr_workers; i++) {
+    workers[i].id = (int)i;
+    workers[i].cpu = pin_workers ? (int)(i % nr_cpus) : -1;
+    int ret =
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    if (ret != 0) {
+      fprintf(stderr, "pthread_create() failed. error = %s\n", strerror(ret));
+      exit(1);
+    }
+  }
+
+  printf("ZeroHTTPd listening on port %d with %ld worker(s), %s parser\n",
+         DEFAULT_SERVER_PORT, nr_workers, parser_impl);
+
+  for (long i = 0; i < nr_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
   return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,732 @@
+#define _GNU_SOURCE /* strcasestr() */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <liburing.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * A load generator for 03_http_liburing.c, built the same way as the
+ * server: every worker thread owns a ring and a share of the connections,
+ * and all socket I/O goes through io_uring.
+ *
+ * In the default closed-loop mode every connection keeps "-p" requests in
+ * flight and sends the next one as soon as a response arrives, which
+ * measures how much the server can take. In open-loop mode ("-r") requests
+ * are started at a constant rate whether or not the server keeps up. Their
+ * latency is measured from the moment they were due, not from when a
+ * connection got free to send them, so a stalling server shows up in the
+ * percentiles instead of just lowering the request rate.
+ * */
+
+#define DEFAULT_SERVER_PORT 8000
+#define QUEUE_DEPTH 1024
+#define RECV_BUF_SZ 16384
+#define HEADER_BUF_SZ 8192
+#define NSEC_PER_SEC 1000000000ULL
+
+/*
+ * Latencies go into an HDR histogram: values below HIST_SUB_BUCKETS
+ * nanoseconds get a bucket each, larger ones are bucketed by their
+ * HIST_SUB_BITS most significant bits. That keeps every value within 0.1%
+ * from 1 ns to hours in a fixed 450 KB array, and histograms of different
+ * workers are merged by adding them up.
+ * */
+#define HIST_SUB_BITS 11
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_HALF_BUCKETS (HIST_SUB_BUCKETS / 2)
+#define HIST_BUCKETS (HIST_SUB_BUCKETS + (64 - HIST_SUB_BITS) * HIST_HALF_BUCKETS)
+
+enum event_type {
+  EVENT_TYPE_CONNECT,
+  EVENT_TYPE_SEND,
+  EVENT_TYPE_RECV,
+  EVENT_TYPE_TIMER,
+};
+
+/*
+ * A connection's requests all look the same, so the send side is just a
+ * byte count: send_pending bytes of the request stream starting at
+ * send_offset still have to be written. The receive side parses one
+ * response at a time, collecting its headers in header[] and then skipping
+ * body_remaining bytes of body.
+ * */
+struct conn {
+  int index;
+  int fd;
+  unsigned gen; /* Bumped on reconnect, so stale completions can be told */
+  bool connected;
+  bool ever_connected;
+
+  uint64_t *start_times; /* FIFO of the in-flight requests' start times */
+  unsigned start_head;
+  unsigned inflight;
+  unsigned queued; /* Entries in the ready queue, open-loop only */
+
+  size_t send_pending;
+  size_t send_offset;
+  size_t send_inflight;
+
+  bool in_body;
+  size_t body_remaining;
+  int status;
+  char header[HEADER_BUF_SZ + 1];
+  size_t header_len;
+  char recv_buf[RECV_BUF_SZ];
+};
+
+struct worker {
+  pthread_t thread;
+  int id;
+  int first_conn;
+  int nr_conns;
+  double rate; /* This worker's share of requests per second, or 0 */
+
+  /* Results */
+  uint64_t completed;
+  uint64_t non_2xx;
+  uint64_t errors;
+  uint64_t connects;
+  uint64_t bytes;
+  uint64_t *histogram;
+};
+
+/* Settings, shared and read-only once the workers run. */
+struct sockaddr_in server_addr;
+char *request;
+size_t request_len;
+char *send_buf; /* depth copies of request, to send pipelined batches from */
+size_t send_buf_len;
+unsigned depth = 1;
+bool keep_alive = true;
+uint64_t duration_ns = 10 * NSEC_PER_SEC;
+
+_Thread_local struct worker *worker;
+_Thread_local struct io_uring ring;
+_Thread_local struct conn *conns;
+_Thread_local bool stopping;
+
+/* Open-loop state: when the next request is due and who can take it. */
+_Thread_local uint64_t interval_ns;
+_Thread_local uint64_t next_due_ns;
+_Thread_local uint64_t backlog;          /* Due, but no connection was free */
+_Thread_local uint64_t backlog_start_ns; /* When the oldest of them was due */
+_Thread_local struct conn **ready;       /* Ring of connections with room */
+_Thread_local unsigned ready_head;
+_Thread_local unsigned ready_count;
+_Thread_local unsigned ready_size;
+
+_Thread_local struct __kernel_timespec timer_ts;
+_Thread_local bool timer_pending;
+
+void fatal_error(const char *syscall) {
+  perror(syscall);
+  exit(1);
+}
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+unsigned hist_index(uint64_t value) {
+  if (value < HIST_SUB_BUCKETS) {
+    return value;
+  }
+
+  int shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+  uint64_t sub = value >> shift; /* In [HIST_HALF_BUCKETS, HIST_SUB_BUCKETS) */
+  return HIST_SUB_BUCKETS + (shift - 1) * HIST_HALF_BUCKETS +
+         (sub - HIST_HALF_BUCKETS);
+}
+
+/* The largest value that lands in a bucket. */
+uint64_t hist_value(unsigned index) {
+  if (index < HIST_SUB_BUCKETS) {
+    return index;
+  }
+
+  unsigned shift = (index - HIST_SUB_BUCKETS) / HIST_HALF_BUCKETS + 1;
+  uint64_t sub = (index - HIST_SUB_BUCKETS) % HIST_HALF_BUCKETS +
+                 HIST_HALF_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
+
+uint64_t hist_percentile(const uint64_t *histogram, uint64_t total,
+                         double percentile) {
+  uint64_t rank = (uint64_t)(percentile / 100 * total + 0.5);
+  if (rank == 0) {
+    rank = 1;
+  }
+
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+    seen += histogram[i];
+    if (seen >= rank) {
+      return hist_value(i);
+    }
+  }
+
+  return 0;
+}
+
+struct io_uring_sqe *get_sqe() {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+  if (sqe == NULL) {
+    io_uring_submit(&ring);
+    sqe = io_uring_get_sqe(&ring);
+  }
+  if (sqe == NULL) {
+    fprintf(stderr, "Could not get SQE.\n");
+    exit(1);
+  }
+
+  return sqe;
+}
+
+/*
+ * user_data: the connection in the upper half, its generation and the event
+ * type in the lower one.
+ * */
+void set_data(struct io_uring_sqe *sqe, struct conn *conn,
+              enum event_type type) {
+  uint64_t index = conn != NULL ? (uint64_t)conn->index : UINT32_MAX;
+  unsigned gen = conn != NULL ? conn->gen : 0;
+  io_uring_sqe_set_data64(sqe, index << 32 | (uint64_t)(gen & 0xffffff) << 8 |
+                                   type);
+}
+
+void queue_timer(uint64_t deadline_ns) {
+  struct io_uring_sqe *sqe = get_sqe();
+
+  timer_ts.tv_sec = deadline_ns / NSEC_PER_SEC;
+  timer_ts.tv_nsec = deadline_ns % NSEC_PER_SEC;
+  io_uring_prep_timeout(sqe, &timer_ts, 0, IORING_TIMEOUT_ABS);
+  set_data(sqe, NULL, EVENT_TYPE_TIMER);
+  timer_pending = true;
+}
+
+void queue_connect(struct conn *conn) {
+  conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (conn->fd < 0) {
+    fatal_error("socket()");
+  }
+
+  int enable = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+  struct io_uring_sqe *sqe = get_sqe();
+  io_uring_prep_connect(sqe, conn->fd, (struct sockaddr *)&server_addr,
+                        sizeof(server_addr));
+  set_data(sqe, conn, EVENT_TYPE_CONNECT);
+}
+
+void queue_recv(struct conn *conn) {
+  struct io_uring_sqe *sqe = get_sqe();
+
+  io_uring_prep_recv(sqe, conn->fd, conn->recv_buf, RECV_BUF_SZ, 0);
+  set_data(sqe, conn, EVENT_TYPE_RECV);
+}
+
+void queue_send(struct conn *conn) {
+  size_t offset = conn->send_offset % request_len;
+  size_t len = send_buf_len - offset;
+  if (len > conn->send_pending) {
+    len = conn->send_pending;
+  }
+
+  struct io_uring_sqe *sqe = get_sqe();
+  io_uring_prep_send(sqe, conn->fd, send_buf + offset, len, MSG_NOSIGNAL);
+  set_data(sqe, conn, EVENT_TYPE_SEND);
+  conn->send_inflight = len;
+}
+
+/*
+ * Starts a request on a connection with room for it. start_ns is what its
+ * latency is measured from.
+ * */
+void issue_request(struct conn *conn, uint64_t start_ns) {
+  conn->start_times[(conn->start_head + conn->inflight) % depth] = start_ns;
+  conn->inflight++;
+  conn->send_pending += request_len;
+
+  /* One send per connection at a time, so requests can't get reordered. */
+  if (conn->send_inflight == 0) {
+    queue_send(conn);
+  }
+}
+
+/* Open-loop: hands out the connection's free slots to the dispatcher. */
+void make_ready(struct conn *conn) {
+  while (conn->inflight + conn->queued < depth) {
+    ready[(ready_head + ready_count++) % ready_size] = conn;
+    conn->queued++;
+  }
+}
+
+/*
+ * Open-loop: turns every request that has come due into a backlog entry,
+ * then starts as many of them as there are free connection slots.
+ * */
+void dispatch_due(uint64_t now) {
+  while (next_due_ns <= now) {
+    if (backlog++ == 0) {
+      backlog_start_ns = next_due_ns;
+    }
+    next_due_ns += interval_ns;
+  }
+
+  while (backlog > 0 && ready_count > 0) {
+    struct conn *conn = ready[ready_head];
+    ready_head = (ready_head + 1) % ready_size;
+    ready_count--;
+    conn->queued--;
+
+    if (!conn->connected) {
+      continue; /* It was reset after it queued up */
+    }
+
+    issue_request(conn, backlog_start_ns);
+    backlog_start_ns += interval_ns;
+    backlog--;
+  }
+}
+
+/* Gives a fresh connection (or one that got its response) work to do. */
+void refill_conn(struct conn *conn, uint64_t now) {
+  if (stopping) {
+    return;
+  }
+
+  if (interval_ns != 0) {
+    make_ready(conn);
+  } else {
+    while (conn->inflight < depth) {
+      issue_request(conn, now);
+    }
+  }
+}
+
+void reset_conn(struct conn *conn) {
+  close(conn->fd);
+  conn->fd = -1;
+  conn->gen++;
+  conn->connected = false;
+  conn->start_head = 0;
+  conn->inflight = 0;
+  conn->send_pending = 0;
+  conn->send_offset = 0;
+  conn->send_inflight = 0;
+  conn->in_body = false;
+  conn->header_len = 0;
+}
+
+/*
+ * The server closed the connection or it broke. Requests still in flight
+ * on it are lost and count as errors.
+ * */
+void reconnect(struct conn *conn) {
+  worker->errors += conn->inflight;
+  reset_conn(conn);
+  if (!stopping) {
+    queue_connect(conn);
+  }
+}
+
+void complete_response(struct conn *conn, uint64_t now) {
+  uint64_t start = conn->start_times[conn->start_head];
+  conn->start_head = (conn->start_head + 1) % depth;
+  conn->inflight--;
+
+  worker->completed++;
+  if (conn->status < 200 || conn->status > 299) {
+    worker->non_2xx++;
+  }
+  worker->histogram[hist_index(now - start)]++;
+
+  /* Without keep-alive the server closes, and we reconnect on EOF. */
+  if (keep_alive) {
+    refill_conn(conn, now);
+  }
+}
+
+/*
+ * Parses response headers once they are complete. Returns false if they
+ * don't look like a response we can follow.
+ * */
+bool parse_response_headers(struct conn *conn) {
+  conn->header[conn->header_len] = '\0';
+  if (strncmp(conn->header, "HTTP/1.", 7) != 0 || conn->header_len < 12) {
+    return false;
+  }
+  conn->status = atoi(conn->header + 9);
+
+  const char *length = strcasestr(conn->header, "\r\ncontent-length:");
+  if (length == NULL) {
+    return false;
+  }
+  conn->body_remaining = strtoull(length + 17, NULL, 10);
+  return true;
+}
+
+/*
+ * Feeds received bytes to the response parser. Returns false on a protocol
+ * error.
+ * */
+bool handle_recv(struct conn *conn, const char *buf, size_t len,
+                 uint64_t now) {
+  while (len > 0) {
+    if (conn->in_body) {
+      size_t n = len < conn->body_remaining ? len : conn->body_remaining;
+      conn->body_remaining -= n;
+      buf += n;
+      len -= n;
+    } else {
+      size_t n = HEADER_BUF_SZ - conn->header_len;
+      if (n == 0) {
+        return false;
+      }
+      n = len < n ? len : n;
+
+      /* Look for the blank line, including where it straddles two reads. */
+      size_t search_from = conn->header_len > 3 ? conn->header_len - 3 : 0;
+      memcpy(conn->header + conn->header_len, buf, n);
+      conn->header_len += n;
+      char *end = memmem(conn->header + search_from,
+                         conn->header_len - search_from, "\r\n\r\n", 4);
+      if (end == NULL) {
+        buf += n;
+        len -= n;
+        continue;
+      }
+
+      /* Whatever followed the blank line is body, or the next response. */
+      size_t used = end + 4 - conn->header - (conn->header_len - n);
+      conn->header_len = end + 4 - conn->header;
+      if (!parse_response_headers(conn)) {
+        return false;
+      }
+      buf += used;
+      len -= used;
+      conn->in_body = true;
+    }
+
+    if (conn->in_body && conn->body_remaining == 0) {
+      if (conn->inflight == 0) {
+        return false; /* A response we never asked for */
+      }
+      conn->in_body = false;
+      conn->header_len = 0;
+      complete_response(conn, now);
+    }
+  }
+
+  return true;
+}
+
+void handle_cqe(struct io_uring_cqe *cqe) {
+  uint64_t data = io_uring_cqe_get_data64(cqe);
+  enum event_type type = data & 0xff;
+  unsigned gen = (data >> 8) & 0xffffff;
+  uint64_t now = now_ns();
+
+  if (type == EVENT_TYPE_TIMER) {
+    timer_pending = false;
+    return;
+  }
+
+  struct conn *conn = &conns[(data >> 32) - worker->first_conn];
+  if (gen != (conn->gen & 0xffffff)) {
+    return; /* From before the connection was reset */
+  }
+
+  switch (type) {
+  case EVENT_TYPE_CONNECT:
+    if (cqe->res < 0) {
+      if (!conn->ever_connected) {
+        fprintf(stderr, "connect() failed. error = %s\n",
+                strerror(-cqe->res));
+        exit(1);
+      }
+      worker->errors++;
+      reconnect(conn);
+      break;
+    }
+
+    conn->connected = true;
+    conn->ever_connected = true;
+    worker->connects++;
+    queue_recv(conn);
+    refill_conn(conn, now);
+    break;
+
+  case EVENT_TYPE_SEND:
+    if (cqe->res < 0) {
+      /* Let the pending receive notice and reconnect. */
+      shutdown(conn->fd, SHUT_RDWR);
+      break;
+    }
+
+    conn->send_inflight = 0;
+    conn->send_pending -= cqe->res;
+    conn->send_offset += cqe->res;
+    if (conn->send_pending > 0) {
+      queue_send(conn);
+    }
+    break;
+
+  case EVENT_TYPE_RECV:
+    if (cqe->res <= 0) {
+      /* EOF after the last response is how a closing server says bye. */
+      if (cqe->res < 0 || conn->inflight > 0 || conn->header_len > 0) {
+        worker->errors++;
+      }
+      reconnect(conn);
+      break;
+    }
+
+    worker->bytes += cqe->res;
+    if (!handle_recv(conn, conn->recv_buf, cqe->res, now)) {
+      worker->errors++;
+      reconnect(conn);
+      break;
+    }
+    queue_recv(conn);
+    break;
+
+  default:
+    fprintf(stderr, "Unexpected event type = %d\n", type);
+    break;
+  }
+}
+
+void *worker_main(void *arg) {
+  worker = arg;
+
+  int ret = io_uring_queue_init(QUEUE_DEPTH, &ring, 0);
+  if (ret < 0) {
+    fprintf(stderr, "io_uring_queue_init() failed. error = %s\n",
+            strerror(-ret));
+    exit(1);
+  }
+
+  worker->histogram = calloc(HIST_BUCKETS, sizeof(*worker->histogram));
+  conns = calloc(worker->nr_conns, sizeof(*conns));
+  if (worker->histogram == NULL || conns == NULL) {
+    fatal_error("calloc()");
+  }
+
+  uint64_t start = now_ns();
+  uint64_t end = start + duration_ns;
+  if (worker->rate > 0) {
+    interval_ns = (uint64_t)(NSEC_PER_SEC / worker->rate);
+    if (interval_ns == 0) {
+      interval_ns = 1;
+    }
+    next_due_ns = start;
+    ready_size = worker->nr_conns * depth;
+    ready = calloc(ready_size, sizeof(*ready));
+  }
+
+  for (int i = 0; i < worker->nr_conns; i++) {
+    conns[i].index = worker->first_conn + i;
+    conns[i].fd = -1;
+    conns[i].start_times = calloc(depth, sizeof(*conns[i].start_times));
+    queue_connect(&conns[i]);
+  }
+
+  while (true) {
+    uint64_t now = now_ns();
+    if (now >= end) {
+      break;
+    }
+
+    if (interval_ns != 0) {
+      dispatch_due(now);
+    }
+    if (!timer_pending) {
+      queue_timer(interval_ns != 0 && next_due_ns < end ? next_due_ns : end);
+    }
+
+    ret = io_uring_submit_and_wait(&ring, 1);
+    if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+      fprintf(stderr, "io_uring_submit_and_wait() failed. error = %s\n",
+              strerror(-ret));
+      exit(1);
+    }
+
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    unsigned count = 0;
+    io_uring_for_each_cqe(&ring, head, cqe) {
+      handle_cqe(cqe);
+      count++;
+    }
+
+    /* Mark the whole batch as processed */
+    io_uring_cq_advance(&ring, count);
+  }
+
+  /* Requests still in flight are simply not counted. */
+  stopping = true;
+  io_uring_queue_exit(&ring);
+  for (int i = 0; i < worker->nr_conns; i++) {
+    close(conns[i].fd);
+  }
+
+  return NULL;
+}
+
+void build_request(const char *path, const char *host) {
+  if (asprintf(&request,
+               "GET %s HTTP/1.1\r\n"
+               "Host: %s\r\n"
+               "%s"
+               "\r\n",
+               path, host, keep_alive ? "" : "Connection: close\r\n") < 0) {
+    fatal_error("asprintf()");
+  }
+  request_len = strlen(request);
+
+  send_buf_len = request_len * depth;
+  send_buf = malloc(send_buf_len);
+  for (unsigned i = 0; i < depth; i++) {
+    memcpy(send_buf + i * request_len, request, request_len);
+  }
+}
+
+void report(struct worker *workers, long nr_workers) {
+  uint64_t completed = 0, non_2xx = 0, errors = 0, connects = 0, bytes = 0;
+  uint64_t *histogram = calloc(HIST_BUCKETS, sizeof(*histogram));
+  for (long i = 0; i < nr_workers; i++) {
+    completed += workers[i].completed;
+    non_2xx += workers[i].non_2xx;
+    errors += workers[i].errors;
+    connects += workers[i].connects;
+    bytes += workers[i].bytes;
+    for (unsigned j = 0; j < HIST_BUCKETS; j++) {
+      histogram[j] += workers[i].histogram[j];
+    }
+  }
+
+  double seconds = (double)duration_ns / NSEC_PER_SEC;
+  printf("Requests:    %lu in %.1fs, %.1f req/s\n", completed, seconds,
+         completed / seconds);
+  printf("Transfer:    %.1f MB, %.1f MB/s\n", bytes / 1e6, bytes / 1e6 / seconds);
+  printf("Non-2xx:     %lu\n", non_2xx);
+  printf("Errors:      %lu\n", errors);
+  printf("Connections: %lu opened\n", connects);
+  if (completed > 0) {
+    printf("Latency:     p50 %.1f us, p99 %.1f us, p99.9 %.1f us, "
+           "max %.1f us\n",
+           hist_percentile(histogram, completed, 50) / 1e3,
+           hist_percentile(histogram, completed, 99) / 1e3,
+           hist_percentile(histogram, completed, 99.9) / 1e3,
+           hist_percentile(histogram, completed, 100) / 1e3);
+  }
+}
+
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] [path]\n"
+          "  -c  connections in total (default 64)\n"
+          "  -w  worker threads, each with its own ring (default 1)\n"
+          "  -d  duration in seconds (default 10)\n"
+          "  -p  requests pipelined on each connection (default 1)\n"
+          "  -C  no keep-alive: one request per connection\n"
+          "  -r  open-loop: start this many requests per second in total\n"
+          "  -H  server address (default 127.0.0.1)\n"
+          "  -P  server port (default %d)\n",
+          prog, DEFAULT_SERVER_PORT);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  long nr_conns = 64;
+  long nr_workers = 1;
+  double rate = 0;
+  const char *host = "127.0.0.1";
+  int port = DEFAULT_SERVER_PORT;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:w:d:p:Cr:H:P:")) != -1) {
+    switch (opt) {
+    case 'c':
+      nr_conns = strtol(optarg, NULL, 10);
+      break;
+    case 'w':
+      nr_workers = strtol(optarg, NULL, 10);
+      break;
+    case 'd':
+      duration_ns = strtod(optarg, NULL) * NSEC_PER_SEC;
+      break;
+    case 'p':
+      depth = strtoul(optarg, NULL, 10);
+      break;
+    case 'C':
+      keep_alive = false;
+      break;
+    case 'r':
+      rate = strtod(optarg, NULL);
+      break;
+    case 'H':
+      host = optarg;
+      break;
+    case 'P':
+      port = (int)strtol(optarg, NULL, 10);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (nr_workers < 1 || nr_conns < nr_workers || depth < 1 ||
+      duration_ns == 0 || rate < 0) {
+    usage(argv[0]);
+  }
+  if (!keep_alive && depth > 1) {
+    fprintf(stderr, "Pipelining needs keep-alive, using -p 1\n");
+    depth = 1;
+  }
+
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, host, &server_addr.sin_addr) != 1) {
+    fprintf(stderr, "Not an IPv4 address: %s\n", host);
+    exit(EXIT_FAILURE);
+  }
+
+  build_request(optind < argc ? argv[optind] : "/", host);
+
+  struct worker *workers = calloc(nr_workers, sizeof(*workers));
+  for (long i = 0; i < nr_workers; i++) {
+    workers[i].id = (int)i;
+    workers[i].first_conn = (int)(nr_conns * i / nr_workers);
+    workers[i].nr_conns =
+        (int)(nr_conns * (i + 1) / nr_workers) - workers[i].first_conn;
+    workers[i].rate = rate / nr_workers;
+    int ret =
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    if (ret != 0) {
+      fprintf(stderr, "pthread_create() failed. error = %s\n", strerror(ret));
+      exit(1);
+    }
+  }
+
+  for (long i = 0; i < nr_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  report(workers, nr_workers);
+  return EXIT_SUCCESS;
+}